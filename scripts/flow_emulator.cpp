@@ -0,0 +1,169 @@
+// Host emulator for the BLE flow controller (src/flow_control.cpp).
+//
+// Models a client streaming an image over a link with a one-way latency and a
+// bandwidth limit, into the device's receive buffer (8 full writes) and a flash writer with
+// jittery per-chunk service time. The client keeps as many chunks in flight as the
+// last FC notification allowed. For each latency, the adaptive run is compared
+// against every fixed in-flight budget.
+//
+//   g++ -std=c++17 -O2 -Isrc scripts/flow_emulator.cpp src/flow_control.cpp -o flow_emulator
+//   ./flow_emulator [image_kb]
+
+#include "flow_control.h"
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <queue>
+#include <random>
+#include <vector>
+
+#define MESSAGE_OVERHEAD 4      // Length prefix per message in a FreeRTOS message buffer
+#define MAX_CHUNK 512           // MTU 517 - 3
+#define BUFFER_BYTES (8 * (MAX_CHUNK + MESSAGE_OVERHEAD)) // STREAM_BUFFER_SIZE in src/ble_ota.cpp
+#define LINK_BYTES_PER_MS 120   // Uplink goodput, roughly 2M PHY with a 15 ms interval
+#define WRITE_BASE_US 1200      // Flash write + hash per chunk, fixed part
+#define WRITE_PER_BYTE_NS 9000  // ... and per byte
+#define WRITE_JITTER 0.3        // Uniform +-30% on each write
+
+enum EventType { CHUNK_ARRIVES, ACK_ARRIVES, HINT_ARRIVES, WRITE_DONE };
+
+struct Event {
+    int64_t at_us;
+    EventType type;
+    size_t a;
+    size_t b;
+    bool operator>(const Event &other) const { return at_us > other.at_us; }
+};
+
+struct Result {
+    double kb_per_s;
+    size_t drops;
+    size_t final_inflight;
+    uint32_t rtt_us;
+};
+
+static Result run(size_t image_bytes, int64_t latency_us, size_t fixed_inflight, unsigned seed) {
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> jitter(1.0 - WRITE_JITTER, 1.0 + WRITE_JITTER);
+    FlowController flow;
+    flow.begin(MAX_CHUNK, BUFFER_BYTES, MESSAGE_OVERHEAD);
+
+    // Client
+    size_t sent = 0;
+    size_t outstanding = 0;
+    size_t chunk = MAX_CHUNK;
+    size_t inflight = fixed_inflight > 0 ? fixed_inflight : 1;
+    int64_t uplink_free_us = 0;
+
+    // Device
+    std::deque<size_t> buffer;
+    size_t buffered_bytes = 0;
+    bool writing = false;
+    size_t written = 0;
+    size_t drops = 0;
+    int64_t done_us = 0;
+
+    auto client_send = [&](int64_t now) {
+        while (outstanding < inflight && sent < image_bytes) {
+            size_t len = image_bytes - sent < chunk ? image_bytes - sent : chunk;
+            int64_t start = now > uplink_free_us ? now : uplink_free_us;
+            uplink_free_us = start + (int64_t)len * 1000 / LINK_BYTES_PER_MS;
+            events.push({uplink_free_us + latency_us, CHUNK_ARRIVES, len, 0});
+            sent += len;
+            outstanding++;
+        }
+    };
+
+    auto start_write = [&](int64_t now) {
+        if (writing || buffer.empty()) return;
+        size_t len = buffer.front();
+        buffer.pop_front();
+        buffered_bytes -= len + MESSAGE_OVERHEAD;
+        writing = true;
+        int64_t service = (int64_t)((WRITE_BASE_US + (double)len * WRITE_PER_BYTE_NS / 1000) * jitter(rng));
+        flow.onChunk(now, service, buffered_bytes);
+        events.push({now + service, WRITE_DONE, len, 0});
+    };
+
+    client_send(0);
+    while (!events.empty() && written < image_bytes) {
+        Event e = events.top();
+        events.pop();
+        switch (e.type) {
+        case CHUNK_ARRIVES:
+            if (buffered_bytes + e.a + MESSAGE_OVERHEAD > BUFFER_BYTES) {
+                // The device never ACKs a dropped chunk; the client resends it after a timeout
+                drops++;
+                flow.onDrop();
+                sent -= e.a;
+                events.push({e.at_us + 200000, ACK_ARRIVES, 0, 0});
+                break;
+            }
+            buffer.push_back(e.a);
+            buffered_bytes += e.a + MESSAGE_OVERHEAD;
+            start_write(e.at_us);
+            break;
+        case WRITE_DONE: {
+            writing = false;
+            written += e.a;
+            if (written >= image_bytes) {
+                done_us = e.at_us;
+                break;
+            }
+            flow.onAckSent(e.at_us);
+            events.push({e.at_us + latency_us, ACK_ARRIVES, 0, 0});
+            size_t c, n;
+            if (fixed_inflight == 0 && flow.poll(&c, &n)) {
+                events.push({e.at_us + latency_us, HINT_ARRIVES, c, n});
+            }
+            start_write(e.at_us);
+            break;
+        }
+        case ACK_ARRIVES:
+            outstanding--;
+            client_send(e.at_us);
+            break;
+        case HINT_ARRIVES:
+            chunk = e.a;
+            inflight = e.b;
+            client_send(e.at_us);
+            break;
+        }
+    }
+
+    Result r;
+    r.kb_per_s = done_us > 0 ? image_bytes / 1024.0 / (done_us / 1e6) : 0;
+    r.drops = drops;
+    r.final_inflight = fixed_inflight > 0 ? fixed_inflight : flow.inflight();
+    r.rtt_us = flow.rttUs();
+    return r;
+}
+
+int main(int argc, char **argv) {
+    size_t image_bytes = (argc > 1 ? atoi(argv[1]) : 600) * 1024;
+    const int latencies_ms[] = {2, 5, 10, 20, 40, 80, 150};
+    // Larger budgets can overflow the buffer if a whole window lands during a slow write
+    const size_t max_fixed = BUFFER_BYTES / (MAX_CHUNK + MESSAGE_OVERHEAD) + 1;
+
+    printf("%u KB image, %d B/ms link, %u B buffer\n\n", (unsigned)(image_bytes / 1024), LINK_BYTES_PER_MS, (unsigned)BUFFER_BYTES);
+    printf("latency | best fixed       | adaptive                                    | legacy (1)\n");
+    for (int latency_ms : latencies_ms) {
+        size_t best_n = 1;
+        Result best = run(image_bytes, latency_ms * 1000, 1, 1);
+        for (size_t n = 2; n <= max_fixed; n++) {
+            Result r = run(image_bytes, latency_ms * 1000, n, 1);
+            if (r.drops == 0 && r.kb_per_s > best.kb_per_s) {
+                best = r;
+                best_n = n;
+            }
+        }
+        Result adaptive = run(image_bytes, latency_ms * 1000, 0, 1);
+        Result legacy = run(image_bytes, latency_ms * 1000, 1, 1);
+        printf("%4d ms | n=%-2u %6.1f KB/s | n=%-2u %6.1f KB/s (%3.0f%%) rtt %5.1f ms, %u drops | %6.1f KB/s\n",
+               latency_ms, (unsigned)best_n, best.kb_per_s, (unsigned)adaptive.final_inflight, adaptive.kb_per_s,
+               100.0 * adaptive.kb_per_s / best.kb_per_s, adaptive.rtt_us / 1000.0, (unsigned)adaptive.drops,
+               legacy.kb_per_s);
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+import argparse
+import os
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+# Plain HTTP image server for the loader's pull mode (NVS key "ota_url").
+# Supports keep-alive and Range requests, and reports per-connection throughput
+# and the peak number of devices served at once.
+
+stats_lock = threading.Lock()
+active_connections = 0
+peak_connections = 0
+drops_remaining = 0
+
+
+class ImageHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # Keep-alive by default
+
+    def setup(self):
+        global active_connections, peak_connections
+        super().setup()
+        self.bytes_sent = 0
+        self.requests = 0
+        self.started = time.monotonic()
+        with stats_lock:
+            active_connections += 1
+            peak_connections = max(peak_connections, active_connections)
+            active = active_connections
+        print(f"[{self.client_address[0]}] connected ({active} active, peak {peak_connections})")
+
+    def finish(self):
+        global active_connections
+        super().finish()
+        elapsed = time.monotonic() - self.started
+        with stats_lock:
+            active_connections -= 1
+        rate = self.bytes_sent / elapsed / 1024 if elapsed > 0 else 0
+        print(f"[{self.client_address[0]}] closed: {self.bytes_sent} bytes, {self.requests} requests, "
+              f"{elapsed:.1f} s, {rate:.1f} KB/s")
+
+    def parse_range(self, size):
+        header = self.headers.get("Range")
+        if not header or not header.startswith("bytes="):
+            return None
+        first, _, last = header[6:].partition("-")
+        first = int(first)
+        last = min(int(last), size - 1) if last else size - 1
+        if first > last:
+            return (first, -1)
+        return (first, last)
+
+    def do_GET(self):
+        global drops_remaining
+        self.requests += 1
+        image = self.server.image
+        size = len(image)
+        byte_range = self.parse_range(size)
+
+        if byte_range is None:
+            first, last = 0, size - 1
+            self.send_response(200)
+        elif byte_range[1] < 0:
+            self.send_response(416)
+            self.send_header("Content-Range", f"bytes */{size}")
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        else:
+            first, last = byte_range
+            self.send_response(206)
+            self.send_header("Content-Range", f"bytes {first}-{last}/{size}")
+
+        body = image[first:last + 1]
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+
+        with stats_lock:
+            drop = drops_remaining > 0 and first > 0
+            if drop:
+                drops_remaining -= 1
+        if drop:
+            # Fault injection: cut the connection halfway through the body
+            self.wfile.write(body[:len(body) // 2])
+            self.bytes_sent += len(body) // 2
+            print(f"[{self.client_address[0]}] dropping connection in bytes {first}-{last}")
+            self.close_connection = True
+            return
+
+        self.wfile.write(body)
+        self.bytes_sent += len(body)
+
+    def log_message(self, format, *args):
+        pass  # Per-connection summaries are printed instead
+
+
+def main():
+    global drops_remaining
+    parser = argparse.ArgumentParser(description="Serve a firmware image for Meshtastic OTA pull mode")
+    parser.add_argument("image", help="firmware .bin to serve")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--drop", type=int, default=0,
+                        help="number of ranged responses to cut short, to exercise resume")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    drops_remaining = args.drop
+
+    server = ThreadingHTTPServer(("", args.port), ImageHandler)
+    server.image = image
+    name = os.path.basename(args.image)
+    print(f"Serving {name} ({len(image)} bytes) at http://<this-host>:{args.port}/{name}")
+    print("Press Ctrl+C to stop.")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        print(f"\nStopping server. Peak concurrent devices: {peak_connections}")
+    finally:
+        server.server_close()
+
+
+if __name__ == "__main__":
+    main()
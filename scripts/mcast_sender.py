@@ -0,0 +1,164 @@
+import argparse
+import hashlib
+import random
+import select
+import socket
+import struct
+import time
+
+# Host side of the multicast OTA mode (see src/mcast_ota.cpp).
+# Streams numbered blocks once to the group, then resends only what devices NACK.
+
+OTA_PORT = 3232
+MCAST_GROUP = "239.255.32.32"
+MAGIC = b"MOTA"
+
+ANNOUNCE = 1
+DATA = 2
+END = 3
+NACK = 4
+DONE = 5
+
+HEADER = struct.Struct("!4sBBHII")   # magic, type, reserved, payload len, session, index
+ANNOUNCE_BODY = struct.Struct("!IHH32s")  # image size, block size, reserved, sha256
+RANGE = struct.Struct("!II")          # first block, count
+
+NACK_WINDOW_SEC = 1.0  # Longer than the device NACK rate limit plus jitter
+
+
+def pack(msg_type, session, index=0, payload=b""):
+    return HEADER.pack(MAGIC, msg_type, 0, len(payload), session, index) + payload
+
+
+def unpack(packet):
+    if len(packet) < HEADER.size:
+        return None
+    magic, msg_type, _, length, session, index = HEADER.unpack_from(packet)
+    if magic != MAGIC or length > len(packet) - HEADER.size:
+        return None
+    return msg_type, session, index, packet[HEADER.size:HEADER.size + length]
+
+
+def parse_nack(payload):
+    missing = set()
+    for offset in range(0, len(payload) - RANGE.size + 1, RANGE.size):
+        first, count = RANGE.unpack_from(payload, offset)
+        missing.update(range(first, first + count))
+    return missing
+
+
+class MulticastSender:
+    """Sends one image to every target at once.
+
+    targets is the multicast group for real devices. The simulator passes one
+    loopback address per simulated device instead; each send counts once, as on air.
+    """
+
+    def __init__(self, image, targets, block_size=1024, rate=100 * 1024, sock=None):
+        self.image = image
+        self.targets = targets
+        self.block_size = block_size
+        self.rate = rate
+        self.blocks = (len(image) + block_size - 1) // block_size
+        self.session = random.getrandbits(32)
+        self.sock = sock or socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+        self.packets_sent = 0
+        self.bytes_sent = 0
+        self.next_send = 0.0
+
+    def send(self, packet):
+        # Pace to the configured rate so slow flash writes on the devices can keep up
+        now = time.monotonic()
+        if self.next_send > now:
+            time.sleep(self.next_send - now)
+        self.next_send = max(now, self.next_send) + len(packet) / self.rate
+        for target in self.targets:
+            self.sock.sendto(packet, target)
+        self.packets_sent += 1
+        self.bytes_sent += len(packet)
+
+    def announce(self):
+        body = ANNOUNCE_BODY.pack(len(self.image), self.block_size, 0, hashlib.sha256(self.image).digest())
+        self.send(pack(ANNOUNCE, self.session, 0, body))
+
+    def send_block(self, index):
+        start = index * self.block_size
+        self.send(pack(DATA, self.session, index, self.image[start:start + self.block_size]))
+
+    def collect(self, done, window):
+        """Gathers NACKs and DONEs for one window. Returns the union of missing blocks."""
+        missing = set()
+        deadline = time.monotonic() + window
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return missing
+            readable, _, _ = select.select([self.sock], [], [], remaining)
+            if not readable:
+                continue
+            packet, addr = self.sock.recvfrom(2048)
+            msg = unpack(packet)
+            if msg is None or msg[1] != self.session:
+                continue
+            msg_type, _, _, payload = msg
+            if msg_type == NACK and addr not in done:
+                missing |= parse_nack(payload)
+            elif msg_type == DONE:
+                done.add(addr)
+
+    def run(self, devices, settle=5.0, timeout=600.0, log=print):
+        """Runs one session until `devices` report DONE or the timeout expires."""
+        started = time.monotonic()
+        done = set()
+        rounds = 0
+
+        for _ in range(3):
+            self.announce()
+        # Devices erase the partition after the announce; blocks sent meanwhile would be lost
+        time.sleep(settle)
+
+        missing = set(range(self.blocks))
+        while len(done) < devices and time.monotonic() - started < timeout:
+            rounds += 1
+            self.announce()  # Lets late joiners in; they NACK everything
+            for index in sorted(missing):
+                self.send_block(index)
+            self.send(pack(END, self.session))
+            missing = self.collect(done, NACK_WINDOW_SEC)
+            log(f"Round {rounds}: {len(done)}/{devices} done, {len(missing)} blocks requested")
+
+        return {
+            "seconds": time.monotonic() - started,
+            "rounds": rounds,
+            "packets": self.packets_sent,
+            "bytes": self.bytes_sent,
+            "done": len(done),
+        }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Multicast a firmware image to a fleet of OTA loaders")
+    parser.add_argument("image", help="firmware .bin to send")
+    parser.add_argument("--devices", type=int, required=True, help="number of devices expected to finish")
+    parser.add_argument("--group", default=MCAST_GROUP)
+    parser.add_argument("--port", type=int, default=OTA_PORT)
+    parser.add_argument("--block-size", type=int, default=1024)
+    parser.add_argument("--rate", type=int, default=100, help="send rate in KB/s")
+    parser.add_argument("--settle", type=float, default=5.0, help="seconds to wait for devices to erase")
+    parser.add_argument("--timeout", type=float, default=600.0)
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+
+    sender = MulticastSender(image, [(args.group, args.port)], args.block_size, args.rate * 1024)
+    print(f"Session {sender.session:08x}: {len(image)} bytes in {sender.blocks} blocks to {args.group}:{args.port}")
+    print(f"SHA-256 {hashlib.sha256(image).hexdigest()} (must match ota_hash on the devices)")
+    stats = sender.run(args.devices, args.settle, args.timeout)
+    print(f"{stats['done']}/{args.devices} devices done in {stats['seconds']:.1f} s, "
+          f"{stats['rounds']} rounds, {stats['packets']} packets")
+
+
+if __name__ == "__main__":
+    main()
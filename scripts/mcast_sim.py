@@ -0,0 +1,187 @@
+import argparse
+import hashlib
+import os
+import random
+import select
+import socket
+import threading
+import time
+
+import mcast_sender as proto
+
+# Localhost simulator for the multicast OTA mode. Each simulated device runs the
+# same session logic as src/mcast_ota.cpp behind a lossy link. The script then
+# compares fleet completion time for one multicast session against pushing the
+# image to the same devices one after another over TCP.
+
+NACK_MIN_INTERVAL = 0.5
+NACK_JITTER = 0.25
+NACK_IDLE = 2.0
+SESSION_TIMEOUT = 30.0
+
+
+class SimDevice(threading.Thread):
+    def __init__(self, name, loss, erase_sec, expected_hash):
+        super().__init__(daemon=True)
+        self.name = name
+        self.loss = loss
+        self.erase_sec = erase_sec
+        self.expected_hash = expected_hash
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.address = self.sock.getsockname()
+        self.image = None
+        self.nacks = 0
+
+    def recv(self, timeout):
+        readable, _, _ = select.select([self.sock], [], [], timeout)
+        if not readable:
+            return None, None
+        packet, addr = self.sock.recvfrom(2048)
+        if random.random() < self.loss:
+            return None, None
+        return proto.unpack(packet), addr
+
+    def drain(self):
+        # Datagrams that arrive while the flash is erasing are lost on the device
+        while select.select([self.sock], [], [], 0)[0]:
+            self.sock.recvfrom(2048)
+
+    def run(self):
+        while True:
+            msg, sender = self.recv(SESSION_TIMEOUT)
+            if msg is None:
+                continue
+            msg_type, session, _, payload = msg
+            if msg_type != proto.ANNOUNCE:
+                continue
+            size, block_size, _, digest = proto.ANNOUNCE_BODY.unpack_from(payload)
+            if digest != self.expected_hash:
+                continue
+            time.sleep(self.erase_sec)
+            self.drain()
+            if self.session(session, size, block_size, sender):
+                return
+
+    def send(self, sender, msg_type, session, payload=b""):
+        self.sock.sendto(proto.pack(msg_type, session, 0, payload), sender)
+
+    def session(self, session, size, block_size, sender):
+        blocks = (size + block_size - 1) // block_size
+        have = [False] * blocks
+        data = bytearray(size)
+        received = 0
+        last_rx = time.monotonic()
+        last_nack = last_rx - NACK_MIN_INTERVAL
+        nack_at = None
+
+        while received < blocks:
+            now = time.monotonic()
+            if now - last_rx > SESSION_TIMEOUT:
+                return False
+            if nack_at is None and now - last_rx > NACK_IDLE and now - last_nack > NACK_IDLE:
+                nack_at = now
+            if nack_at is not None and now >= nack_at:
+                self.send(sender, proto.NACK, session, self.nack_payload(have))
+                self.nacks += 1
+                last_nack = now
+                nack_at = None
+
+            msg, _ = self.recv(0.05)
+            if msg is None or msg[1] != session:
+                continue
+            msg_type, _, index, payload = msg
+            last_rx = time.monotonic()
+            if msg_type == proto.END and nack_at is None:
+                nack_at = max(last_rx + random.random() * NACK_JITTER, last_nack + NACK_MIN_INTERVAL)
+            elif msg_type == proto.DATA and index < blocks and not have[index]:
+                data[index * block_size:index * block_size + len(payload)] = payload
+                have[index] = True
+                received += 1
+
+        if hashlib.sha256(data).digest() != self.expected_hash:
+            return False
+        self.image = bytes(data)
+        for _ in range(3):
+            self.send(sender, proto.DONE, session)
+        return True
+
+    @staticmethod
+    def nack_payload(have):
+        ranges = []
+        i = 0
+        while i < len(have) and len(ranges) < 64:
+            if have[i]:
+                i += 1
+                continue
+            first = i
+            while i < len(have) and not have[i]:
+                i += 1
+            ranges.append(proto.RANGE.pack(first, i - first))
+        return b"".join(ranges)
+
+
+def run_fleet(image, count, args):
+    digest = hashlib.sha256(image).digest()
+    devices = [SimDevice(f"dev{i}", args.loss, args.erase, digest) for i in range(count)]
+    for device in devices:
+        device.start()
+    sender = proto.MulticastSender(image, [d.address for d in devices], args.block_size, args.rate * 1024)
+    stats = sender.run(count, settle=args.erase + 0.2, timeout=args.timeout, log=lambda _: None)
+    stats["verified"] = sum(1 for d in devices if d.image == image)
+    stats["nacks"] = sum(d.nacks for d in devices)
+    return stats
+
+
+def unicast_push(size, args):
+    """Models one TCP push: the erase, then every block paced at the same rate.
+
+    A lost block is resent right away, as TCP's fast retransmit would. There is no
+    settle time, END/NACK round or collect window, so this favours unicast.
+    """
+    blocks = (size + args.block_size - 1) // args.block_size
+    packets = 0
+    sent_bytes = 0
+    for index in range(blocks):
+        length = min(args.block_size, size - index * args.block_size)
+        while True:
+            packets += 1
+            sent_bytes += length
+            if random.random() >= args.loss:
+                break
+    return {"seconds": args.erase + sent_bytes / (args.rate * 1024), "packets": packets}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate multicast OTA with loss and compare against sequential TCP pushes")
+    parser.add_argument("--devices", type=int, default=8)
+    parser.add_argument("--size", type=int, default=256 * 1024, help="image size in bytes")
+    parser.add_argument("--loss", type=float, default=0.05, help="per-device packet loss probability")
+    parser.add_argument("--block-size", type=int, default=1024)
+    parser.add_argument("--rate", type=int, default=1024, help="send rate in KB/s")
+    parser.add_argument("--erase", type=float, default=0.5, help="simulated erase time in seconds")
+    parser.add_argument("--timeout", type=float, default=300.0)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    random.seed(args.seed)
+    image = os.urandom(args.size)
+    print(f"{args.devices} devices, {args.size} byte image, {args.loss:.0%} loss, {args.rate} KB/s")
+
+    multicast = run_fleet(image, args.devices, args)
+    print(f"Multicast:           {multicast['seconds']:6.1f} s, {multicast['packets']:6d} packets, "
+          f"{multicast['rounds']} rounds, {multicast['nacks']} NACKs, {multicast['verified']}/{args.devices} verified")
+
+    unicast_seconds = 0.0
+    unicast_packets = 0
+    for _ in range(args.devices):
+        stats = unicast_push(len(image), args)
+        unicast_seconds += stats["seconds"]
+        unicast_packets += stats["packets"]
+    print(f"Sequential TCP push: {unicast_seconds:6.1f} s, {unicast_packets:6d} packets (modelled)")
+    if multicast["seconds"] > 0:
+        print(f"Speedup: {unicast_seconds / multicast['seconds']:.1f}x")
+
+
+if __name__ == "__main__":
+    main()
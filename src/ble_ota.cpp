@@ -1,35 +1,88 @@
 #include "ble_ota.h"
 #include "common_log.h"
+#include "dlog.h"
 #include "ota_processor.h" 
+#include "ota_session.h"
 #include "nvs_config.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/stream_buffer.h"
+#include "freertos/message_buffer.h"
+#include "freertos/event_groups.h"
 #include "esp_mac.h"
 #include "esp_task_wdt.h"
+#include "esp_timer.h"
 #include "NimBLEDevice.h"
 #include <string>
+#include <cstring>
+#include <atomic>
 #include "utils.h"
+#include "flow_control.h"
 
 #define TAG "BLE_OTA"
 #define SERVICE_UUID "4FAFC201-1FB5-459E-8FCC-C5C9C331914B"
 #define CHARACTERISTIC_TX_UUID "62ec0272-3ec5-11eb-b378-0242ac130003"
 #define CHARACTERISTIC_OTA_UUID "62ec0272-3ec5-11eb-b378-0242ac130005"
 
+// Each write is one message, so every chunk is processed and ACKed on its own.
+#define MESSAGE_OVERHEAD sizeof(size_t) // Length stored with each message
+#define MAX_CHUNK 512                   // Largest attribute value
 // Buffer size: Enough to hold a few MTU packets. 
-// MTU ~517. 4KB buffer provides enough slack for flash write latency.
-#define STREAM_BUFFER_SIZE 4096 
+// MTU ~517. 8 full writes (as a 4KB stream buffer held) provide enough slack for flash write latency.
+#define STREAM_BUFFER_SIZE (8 * (MAX_CHUNK + MESSAGE_OVERHEAD))
+
+#define REBOOT_FLUSH_TIMEOUT_MS 2000
+#define REBOOT_DISCONNECT_TIMEOUT_MS 500
+#define BIT_NOTIFY_DONE BIT0   // Set when no notification is waiting in the NimBLE host
+#define BIT_DISCONNECTED BIT1
 
 static BLEServer *pServer = NULL;
 static BLECharacteristic *pTxCharacteristic;
 static BLECharacteristic *pOtaCharacteristic;
 static bool deviceConnected = false;
 static bool oldDeviceConnected = false;
-static OtaProcessor otaProcessor;
-static StreamBufferHandle_t xStreamBuffer = NULL;
+static OtaProcessor &otaProcessor = ota_session_processor();
+static MessageBufferHandle_t xMessageBuffer = NULL;
+static EventGroupHandle_t xTxEvents = NULL;
+static std::atomic<int> notifyPending{0};
+static uint16_t connHandle = 0;
+// Only touched from the BLE task; the NimBLE callbacks hand over through the atomics
+static FlowController flowController;
+static std::atomic<bool> flowRestart{false};
+static std::atomic<uint16_t> linkMtu{BLE_ATT_MTU_DFLT};
+static std::atomic<uint32_t> rxDrops{0};
+static std::atomic<bool> disconnectPending{false};
+static std::atomic<bool> rejectedClient{false};     // Current link was refused in onConnect
+static std::atomic<bool> advertiseRestart{false};
+
+static void notifyDone() {
+    notifyPending = 0;
+    xEventGroupSetBits(xTxEvents, BIT_NOTIFY_DONE);
+}
+
+// Called from the BLE task, the only caller of process(), so the reset cannot land mid-chunk.
+// Must run before advertising restarts, so the next BLE client starts from a clean session.
+static void endBleSession() {
+    if (!disconnectPending.exchange(false)) return;
+    // Writes still queued must not reach whichever transport owns the session next.
+    // Done here rather than in onDisconnect: a reset fails while this task waits on the buffer.
+    xMessageBufferReset(xMessageBuffer);
+    // A finished update keeps the session so the reboot check below still fires
+    if (ota_session_owned_by(SESSION_BLE) && !otaProcessor.isRebootRequired()) {
+        otaProcessor.reset();
+        ota_session_release(SESSION_BLE);
+    }
+}
 
 class MyServerCallbacks : public BLEServerCallbacks {
     void onConnect(BLEServer *pServer, NimBLEConnInfo& connInfo) override {
+        // WiFi may already be updating the device
+        if (!ota_session_acquire(SESSION_BLE)) {
+            // Never counted as connected, so onDisconnect has to bring advertising back itself
+            rejectedClient = true;
+            pServer->disconnect(connInfo.getConnHandle());
+            return;
+        }
+
         // Boost power and request faster intervals
         esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_CONN_HDL0, ESP_PWR_LVL_P9);
         esp_ble_tx_power_set(ESP_BLE_PWR_TYPE_CONN_HDL1, ESP_PWR_LVL_P9);
@@ -39,55 +92,99 @@ class MyServerCallbacks : public BLEServerCallbacks {
         pServer->updateConnParams(connInfo.getConnHandle(), 12, 12, 0, 400); 
         
         deviceConnected = true;
+        connHandle = connInfo.getConnHandle();
+        xEventGroupClearBits(xTxEvents, BIT_DISCONNECTED);
+        notifyDone();
         
         nvs_config_t config;
         nvs_read_config(&config);
-        // Set the hash in the static otaProcessor instance
+        // Set the hash in the shared otaProcessor instance
         otaProcessor.setNvramExpectedHash(config.ota_hash);
 
-        // Reset Processor and Buffer
+        // Reset Processor (the BLE task emptied the buffer when the last client left)
         otaProcessor.reset();
         otaProcessor.setAckEnabled(true);
-        xStreamBufferReset(xStreamBuffer); 
+        linkMtu = connInfo.getMTU();
+        rxDrops = 0;
+        flowRestart = true;
         
         otaProcessor.setSender([](const char* data, size_t len) {
+            if (len == 3 && memcmp(data, "ACK", 3) == 0) flowController.onAckSent(esp_timer_get_time());
+            notifyPending++;
+            xEventGroupClearBits(xTxEvents, BIT_NOTIFY_DONE);
             pTxCharacteristic->setValue((const uint8_t*)data, len);
-            pTxCharacteristic->notify();
+            if (!pTxCharacteristic->notify()) notifyDone(); // Nothing queued, nothing to wait for
+        });
+        // Completion comes from TxCallback::onStatus. For notifications NimBLE raises it inside notify(),
+        // once the packet is queued towards the controller, so this confirms the hand-off, not that
+        // the packet went over the air. It returns at once in practice; only the reboot path, which
+        // also waits for the disconnect, knows the client has everything.
+        otaProcessor.setFlusher([](uint32_t timeout_ms) {
+            EventBits_t bits = xEventGroupWaitBits(xTxEvents, BIT_NOTIFY_DONE, pdFALSE, pdFALSE, timeout_ms / portTICK_PERIOD_MS);
+            return (bits & BIT_NOTIFY_DONE) != 0;
         });
         
         INFO("BLE Client Connected");
     }
 
     void onDisconnect(BLEServer *pServer, NimBLEConnInfo& connInfo, int reason) override {
+        if (rejectedClient.exchange(false)) {
+            // Owned nothing; only advertising needs to come back for when WiFi lets go
+            advertiseRestart = true;
+            INFO("Rejected client disconnected (reason: %d)", reason);
+            return;
+        }
+        disconnectPending = true; // The BLE task resets the processor and releases the session
         deviceConnected = false;
-        otaProcessor.reset();
+        notifyDone(); // Nothing left to flush, release any waiter
+        xEventGroupSetBits(xTxEvents, BIT_DISCONNECTED);
         INFO("App disconnected (reason: %d)", reason);
     }
+
+    void onMTUChange(uint16_t MTU, NimBLEConnInfo& connInfo) override {
+        linkMtu = MTU;
+    }
+};
+
+class TxCallback : public BLECharacteristicCallbacks {
+    void onStatus(BLECharacteristic *pCharacteristic, int code) override {
+        // Called once per notification, on success or failure, synchronously from notify() once the
+        // host has queued it for the controller. Either way it is no longer pending in the host.
+        if (--notifyPending <= 0) notifyDone();
+    }
 };
 
 class otaCallback : public BLECharacteristicCallbacks {
     void onWrite(BLECharacteristic *pCharacteristic, NimBLEConnInfo& connInfo) override {
+        if (!ota_session_owned_by(SESSION_BLE)) return;
         std::string rxData = pCharacteristic->getValue();
         if (rxData.length() > 0) {
             // Non-blocking push to buffer. 
-            // If buffer is full, we drop data (wait time 0).
+            // If buffer is full, we drop the whole write (wait time 0).
             // Flow control relies on the Client not sending too fast.
-            size_t bytesSent = xStreamBufferSend(xStreamBuffer, rxData.data(), rxData.length(), 0);
+            size_t bytesSent = xMessageBufferSend(xMessageBuffer, rxData.data(), rxData.length(), 0);
             
             if (bytesSent != rxData.length()) {
-                // This log indicates the Swift delay is too short
-                // Using printf directly as this runs in BLE context, avoid heavy logging if possible
-                printf("E: StreamBuffer Full! Dropped %u bytes\n", (unsigned int)(rxData.length() - bytesSent));
+                // The client has more in flight than the last FC hint (or its delay is too short)
+                // Deferred: this runs in the NimBLE host context, which must not wait on the UART
+                rxDrops++;
+                DWARN("MessageBuffer Full! Dropped %u bytes", (unsigned int)rxData.length());
             }
         }
     }
 };
 
 void ble_ota_task(void *param) {
-    // Create Stream Buffer
-    xStreamBuffer = xStreamBufferCreate(STREAM_BUFFER_SIZE, 1);
-    if (xStreamBuffer == NULL) {
-        FAIL("Failed to create StreamBuffer");
+    xTxEvents = xEventGroupCreate();
+    if (xTxEvents == NULL) {
+        FAIL("Failed to create event group");
+    }
+    xEventGroupSetBits(xTxEvents, BIT_NOTIFY_DONE | BIT_DISCONNECTED);
+
+    // Create Message Buffer
+    xMessageBuffer = xMessageBufferCreate(STREAM_BUFFER_SIZE);
+    if (xMessageBuffer == NULL) {
+        FAIL("Failed to create MessageBuffer");
     }
 
     vTaskDelay(500 / portTICK_PERIOD_MS);
@@ -109,6 +206,7 @@ void ble_ota_task(void *param) {
     
     NimBLEService *pService = pServer->createService(SERVICE_UUID);
     pTxCharacteristic = pService->createCharacteristic(CHARACTERISTIC_TX_UUID, NIMBLE_PROPERTY::NOTIFY);
+    pTxCharacteristic->setCallbacks(new TxCallback());
     pOtaCharacteristic = pService->createCharacteristic(CHARACTERISTIC_OTA_UUID, NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR);
     pOtaCharacteristic->setCallbacks(new otaCallback());
     
@@ -119,22 +217,51 @@ void ble_ota_task(void *param) {
     pAdvertising->start();
     
     INFO("BLE Advertising started.");
+    ota_session_mark_ready(SESSION_BLE);
 
-    uint8_t rxBuffer[520]; // Temp buffer to read from StreamBuffer
+    uint8_t rxBuffer[520]; // Temp buffer to read from MessageBuffer, must hold the largest write
+    uint16_t appliedMtu = 0;
 
     while(1) {
         // 1. Process Incoming Data
+        if (flowRestart.exchange(false)) {
+            appliedMtu = 0;
+            flowController.begin(MAX_CHUNK, STREAM_BUFFER_SIZE, MESSAGE_OVERHEAD);
+        }
         // Wait up to 10ms for data. If data arrives, process it immediately.
         // This effectively throttles the loop to the incoming data rate or idle rate.
-        size_t receivedBytes = xStreamBufferReceive(xStreamBuffer, rxBuffer, sizeof(rxBuffer), 10 / portTICK_PERIOD_MS);
+        size_t receivedBytes = xMessageBufferReceive(xMessageBuffer, rxBuffer, sizeof(rxBuffer), 10 / portTICK_PERIOD_MS);
+        endBleSession();
         
-        if (receivedBytes > 0) {
+        // WiFi may own the session; leftovers from a departed BLE client are dropped
+        if (receivedBytes > 0 && ota_session_owned_by(SESSION_BLE)) {
+            int64_t arrival = esp_timer_get_time();
+            size_t backlog = STREAM_BUFFER_SIZE - xMessageBufferSpacesAvailable(xMessageBuffer);
+            bool isChunk = otaProcessor.isDownloading();
             otaProcessor.process(rxBuffer, receivedBytes);
+            if (isChunk) flowController.onChunk(arrival, esp_timer_get_time() - arrival, backlog);
+        }
+
+        // 2. Flow Control Hints
+        for (uint32_t drops = rxDrops.exchange(0); drops > 0; drops--) {
+            flowController.onDrop();
+        }
+        uint16_t mtu = linkMtu;
+        if (mtu != appliedMtu) {
+            appliedMtu = mtu;
+            flowController.setMaxChunk(mtu - 3 < MAX_CHUNK ? mtu - 3 : MAX_CHUNK);
+        }
+        size_t chunk, inflight;
+        if (ota_session_owned_by(SESSION_BLE) && otaProcessor.isFlowEnabled() && flowController.poll(&chunk, &inflight)) {
+            DINFO("Flow: %u byte chunks, %u in flight (rtt %lu us, write %lu us)", (unsigned int)chunk,
+                  (unsigned int)inflight, (unsigned long)flowController.rttUs(), (unsigned long)flowController.serviceUs());
+            otaProcessor.sendFlowHint(chunk, inflight);
         }
 
-        // 2. Connection Maintenance
+        // 3. Connection Maintenance
         if (!deviceConnected && oldDeviceConnected) {
             // Just disconnected
+            endBleSession();
             vTaskDelay(500 / portTICK_PERIOD_MS); 
             pServer->startAdvertising();
             INFO("Restart advertising");
@@ -143,11 +270,24 @@ void ble_ota_task(void *param) {
         if (deviceConnected && !oldDeviceConnected) {
             oldDeviceConnected = deviceConnected;
         }
+        if (advertiseRestart.exchange(false)) {
+            pServer->startAdvertising();
+            INFO("Restart advertising");
+        }
 
-        // 3. Check for Reboot Flag
-        if (otaProcessor.isRebootRequired()) {
-            INFO("Reboot flag detected. Restarting in 2 seconds...");
-            vTaskDelay(2000 / portTICK_PERIOD_MS); // Allow time for BLE notification to flush
+        // 4. Check for Reboot Flag
+        if (ota_session_owned_by(SESSION_BLE) && otaProcessor.isRebootRequired()) {
+            INFO("Reboot flag detected. Flushing final response...");
+            if (!otaProcessor.flush(REBOOT_FLUSH_TIMEOUT_MS)) {
+                WARN("Final notification not confirmed");
+            }
+            // The controller sends queued data before the terminate, so a completed
+            // disconnect means the client has the response.
+            if (deviceConnected) {
+                pServer->disconnect(connHandle);
+                xEventGroupWaitBits(xTxEvents, BIT_DISCONNECTED, pdFALSE, pdFALSE, REBOOT_DISCONNECT_TIMEOUT_MS / portTICK_PERIOD_MS);
+            }
+            INFO("Restarting.");
             esp_restart();
         }
 
@@ -0,0 +1,83 @@
+#include "dlog.h"
+#include "common_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <atomic>
+
+#define TAG "DLOG"
+#define DLOG_RING_SIZE 32 // Power of two
+#define DLOG_DRAIN_INTERVAL_MS 50
+
+typedef struct {
+    std::atomic<uint32_t> seq; // Ring position this slot is ready for (see dlog_push)
+    uint32_t timestamp;
+    const char *tag;
+    const char *format;
+    uintptr_t args[DLOG_MAX_ARGS];
+    char level;
+    uint8_t nargs;
+} dlog_entry_t;
+
+// Bounded multi-producer ring (NimBLE host, BLE and network tasks), drained by one task.
+// A slot is free for producer position p when seq == p, and holds a record when seq == p + 1.
+static dlog_entry_t s_ring[DLOG_RING_SIZE];
+static std::atomic<uint32_t> s_head{0};
+static uint32_t s_tail = 0; // Only touched by the drain task
+static std::atomic<uint32_t> s_dropped{0};
+static bool s_started = false;
+
+void dlog_push(char level, const char *tag, const char *format, const uintptr_t *args, uint8_t nargs) {
+    if (!s_started) return;
+
+    dlog_entry_t *entry;
+    uint32_t pos = s_head.load(std::memory_order_relaxed);
+    while (true) {
+        entry = &s_ring[pos & (DLOG_RING_SIZE - 1)];
+        int32_t diff = (int32_t)(entry->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (s_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            s_dropped.fetch_add(1, std::memory_order_relaxed); // Full, never block the caller
+            return;
+        } else {
+            pos = s_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    entry->timestamp = esp_log_timestamp();
+    entry->tag = tag;
+    entry->format = format;
+    entry->level = level;
+    entry->nargs = nargs;
+    for (uint8_t i = 0; i < nargs; i++) entry->args[i] = args[i];
+    entry->seq.store(pos + 1, std::memory_order_release);
+}
+
+static void dlog_task(void *param) {
+    while (true) {
+        dlog_entry_t *entry = &s_ring[s_tail & (DLOG_RING_SIZE - 1)];
+        if (entry->seq.load(std::memory_order_acquire) != s_tail + 1) {
+            uint32_t dropped = s_dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) WARN("%lu deferred log records dropped", (unsigned long)dropped);
+            vTaskDelay(DLOG_DRAIN_INTERVAL_MS / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        const uintptr_t *a = entry->args;
+        printf("%c (%lu) %s: ", entry->level, (unsigned long)entry->timestamp, entry->tag);
+        printf(entry->format, a[0], a[1], a[2], a[3]);
+        printf("\r\n");
+
+        entry->seq.store(s_tail + DLOG_RING_SIZE, std::memory_order_release);
+        s_tail++;
+    }
+}
+
+void dlog_start() {
+    for (uint32_t i = 0; i < DLOG_RING_SIZE; i++) s_ring[i].seq.store(i, std::memory_order_relaxed);
+#if DLOG_LEVEL > DLOG_LEVEL_NONE
+    // Lowest priority above idle: logs wait for the transfer, never the other way round
+    if (xTaskCreate(dlog_task, "dlog", 2048, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) return;
+    s_started = true;
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// --- Deferred Logging for Hot Paths ---
+// DINFO/DWARN record the format pointer and up to 4 integer arguments into a lock-free
+// ring and return. A low-priority task formats and prints them later, so the caller never
+// waits on the UART. Arguments must be integers or pointers to static strings (e.g. TAG).
+// Records are dropped, and counted, when the ring is full.
+
+#define DLOG_LEVEL_NONE 0
+#define DLOG_LEVEL_WARN 1
+#define DLOG_LEVEL_INFO 2
+
+// Compile-time filter: disabled levels expand to nothing, format strings included
+#ifndef DLOG_LEVEL
+#define DLOG_LEVEL DLOG_LEVEL_INFO
+#endif
+
+#define DLOG_MAX_ARGS 4
+
+void dlog_start();
+void dlog_push(char level, const char *tag, const char *format, const uintptr_t *args, uint8_t nargs);
+
+template <typename... Args>
+static inline void dlog_write(char level, const char *tag, const char *format, Args... args) {
+    static_assert(sizeof...(Args) <= DLOG_MAX_ARGS, "Too many arguments for deferred log");
+    const uintptr_t argv[DLOG_MAX_ARGS + 1] = { (uintptr_t)args..., 0 };
+    dlog_push(level, tag, format, argv, sizeof...(Args));
+}
+
+#if DLOG_LEVEL >= DLOG_LEVEL_INFO
+#define DINFO(format, ...) dlog_write('I', TAG, format, ##__VA_ARGS__)
+#else
+#define DINFO(format, ...) do {} while (0)
+#endif
+
+#if DLOG_LEVEL >= DLOG_LEVEL_WARN
+#define DWARN(format, ...) dlog_write('W', TAG, format, ##__VA_ARGS__)
+#else
+#define DWARN(format, ...) do {} while (0)
+#endif
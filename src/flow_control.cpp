@@ -0,0 +1,112 @@
+#include "flow_control.h"
+
+#define FC_PROBE_SAMPLES 4     // Round trips measured before leaving one chunk in flight
+#define FC_WINDOW_MIN 8        // Chunks per adjustment window, at least twice the budget
+#define FC_QUEUE_LOW_X16 8     // Below half a chunk queued on average, the writer is starved
+#define FC_QUEUE_HIGH_X16 32   // Above two chunks queued on average, the budget is too large
+#define FC_EWMA_SHIFT 3        // Smoothing weight 1/8
+
+static uint32_t ewma(uint32_t average, int64_t sample) {
+    if (sample < 0) sample = 0;
+    if (sample > UINT32_MAX) sample = UINT32_MAX;
+    if (average == 0) return (uint32_t)sample;
+    return (uint32_t)((int64_t)average + (sample - (int64_t)average) / (1 << FC_EWMA_SHIFT));
+}
+
+FlowController::FlowController() {
+    begin(20, 0, 0);
+}
+
+void FlowController::begin(size_t max_chunk, size_t buffer_bytes, size_t overhead) {
+    _max_chunk = max_chunk;
+    _buffer_bytes = buffer_bytes;
+    _overhead = overhead;
+    _chunk = max_chunk;
+    _inflight = 1;
+    _changed = true;
+    _probing = true;
+    _rtt_samples = 0;
+    _last_ack_us = -1;
+    _rtt_us = 0;
+    _service_us = 0;
+    _window_chunks = 0;
+    _window_backlog = 0;
+    _drops = 0;
+}
+
+void FlowController::setMaxChunk(size_t max_chunk) {
+    if (max_chunk == _max_chunk) return;
+    _max_chunk = max_chunk;
+    _chunk = max_chunk;
+    _changed = true;
+    // Per-chunk timings no longer apply
+    _service_us = 0;
+    setInflight(_inflight);
+}
+
+void FlowController::onAckSent(int64_t now_us) {
+    _last_ack_us = now_us;
+}
+
+void FlowController::onChunk(int64_t arrival_us, int64_t service_us, size_t backlog_bytes) {
+    _service_us = ewma(_service_us, service_us);
+
+    if (_inflight == 1 && _last_ack_us >= 0 && arrival_us >= _last_ack_us && backlog_bytes == 0) {
+        // Nothing else was outstanding, so this chunk was sent in reply to the last ACK
+        _rtt_us = ewma(_rtt_us, arrival_us - _last_ack_us);
+        _rtt_samples++;
+    }
+
+    if (_probing) {
+        if (_rtt_samples < FC_PROBE_SAMPLES || _service_us == 0) return;
+        _probing = false;
+        // Enough chunks to cover one round trip at the writer's pace, plus the one being written
+        setInflight((_rtt_us + _service_us - 1) / _service_us + 1);
+        return;
+    }
+
+    _window_chunks++;
+    _window_backlog += backlog_bytes;
+    size_t window = _inflight * 2 > FC_WINDOW_MIN ? _inflight * 2 : FC_WINDOW_MIN;
+    if (_window_chunks < window) return;
+
+    uint64_t queued_x16 = _window_backlog * 16 / (_window_chunks * (_chunk + _overhead));
+    if (_drops > 0) {
+        setInflight(_inflight / 2);
+    } else if (queued_x16 < FC_QUEUE_LOW_X16) {
+        setInflight(_inflight + 1);
+    } else if (queued_x16 > FC_QUEUE_HIGH_X16) {
+        setInflight(_inflight - 1);
+    }
+    _window_chunks = 0;
+    _window_backlog = 0;
+    _drops = 0;
+}
+
+void FlowController::onDrop() {
+    _drops++;
+}
+
+bool FlowController::poll(size_t *chunk, size_t *inflight) {
+    if (!_changed) return false;
+    _changed = false;
+    *chunk = _chunk;
+    *inflight = _inflight;
+    return true;
+}
+
+size_t FlowController::maxInflight() const {
+    // One outstanding chunk is always out of the buffer, being written
+    size_t per_chunk = _chunk + _overhead;
+    return (per_chunk > 0 ? _buffer_bytes / per_chunk : 0) + 1;
+}
+
+void FlowController::setInflight(size_t inflight) {
+    size_t max = maxInflight();
+    if (inflight > max) inflight = max;
+    if (inflight < 1) inflight = 1;
+    if (inflight != _inflight) {
+        _inflight = inflight;
+        _changed = true;
+    }
+}
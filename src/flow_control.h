@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// --- BLE Flow Control ---
+// Recommends the chunk size and the number of chunks a client may have in flight
+// (written but not yet ACKed). The BLE task feeds it the ACK send times, when each
+// chunk reached the task, how long the processor took on it and how many bytes were
+// still queued behind it.
+//
+// 1. Probe: the client starts with one chunk in flight, so the gap between an ACK
+//    and the next chunk is a full round trip. After a few samples the budget jumps
+//    to round trip / service time + 1, enough to keep the writer busy.
+// 2. Track: every window the average queue behind the writer is checked. An empty
+//    queue means the writer waited on the link (one more chunk in flight), a standing
+//    queue means chunks only wait on flash (one less). Drops halve the budget.
+//
+// The budget never exceeds what the receive buffer can hold, so a client that
+// follows it cannot overflow the buffer. No ESP-IDF dependencies: the same code
+// runs on the host in scripts/flow_emulator.cpp.
+
+class FlowController {
+public:
+    FlowController();
+
+    // Starts over for a new connection. max_chunk is the largest write the link
+    // carries, buffer_bytes the receive buffer and overhead its cost per message.
+    void begin(size_t max_chunk, size_t buffer_bytes, size_t overhead);
+    // The MTU exchange can finish after the connection is up
+    void setMaxChunk(size_t max_chunk);
+
+    void onAckSent(int64_t now_us);
+    void onChunk(int64_t arrival_us, int64_t service_us, size_t backlog_bytes);
+    void onDrop();
+
+    // Returns true, with the new values, when the recommendation changed since the last call
+    bool poll(size_t *chunk, size_t *inflight);
+
+    size_t chunk() const { return _chunk; }
+    size_t inflight() const { return _inflight; }
+    uint32_t rttUs() const { return _rtt_us; }
+    uint32_t serviceUs() const { return _service_us; }
+
+private:
+    size_t _max_chunk;
+    size_t _buffer_bytes;
+    size_t _overhead;
+
+    size_t _chunk;
+    size_t _inflight;
+    bool _changed;
+    bool _probing;
+    int _rtt_samples;
+
+    int64_t _last_ack_us;   // -1 until the first ACK
+    uint32_t _rtt_us;       // Smoothed ACK -> next chunk, sampled with one chunk in flight
+    uint32_t _service_us;   // Smoothed processor time per chunk
+
+    // Current adjustment window
+    size_t _window_chunks;
+    uint64_t _window_backlog;
+    uint32_t _drops;
+
+    size_t maxInflight() const;
+    void setInflight(size_t inflight);
+};
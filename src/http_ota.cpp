@@ -0,0 +1,324 @@
+#include "http_ota.h"
+#include "common_log.h"
+#include "ota_processor.h"
+#include "ota_session.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+#include "utils.h"
+
+#define TAG "HTTP_OTA"
+#define HTTP_RANGE_SIZE (64 * 1024)   // Bytes per ranged GET. Bounds the work lost to a dropped connection.
+#define HTTP_MAX_RETRIES 10           // Consecutive failed requests (without progress) before giving up
+#define HTTP_RETRY_DELAY_MS 1000
+#define HTTP_IO_TIMEOUT_SEC 10
+#define HTTP_HEADER_MAX 768
+
+typedef struct {
+    char host[64];
+    char port[6];
+    const char *path;
+    int sock;
+    unsigned long requests;
+    unsigned long connects;
+} http_client_t;
+
+typedef struct {
+    int status;
+    size_t content_length;
+    size_t range_start;
+    size_t total_size;
+    bool keep_alive;
+} http_response_t;
+
+// Kept off the main task stack.
+static char s_header[HTTP_HEADER_MAX];
+static uint8_t s_rx_buffer[1024];
+
+// Only plain "http://host[:port]/path" URLs are supported (TLS is compiled out).
+static bool parse_url(const char *url, http_client_t *client) {
+    if (strncmp(url, "http://", 7) != 0) return false;
+    const char *host = url + 7;
+    const char *path = strchr(host, '/');
+    size_t host_len = path ? (size_t)(path - host) : strlen(host);
+    client->path = path ? path : "/";
+
+    const char *colon = (const char *)memchr(host, ':', host_len);
+    size_t name_len = colon ? (size_t)(colon - host) : host_len;
+    if (name_len == 0 || name_len >= sizeof(client->host)) return false;
+    memcpy(client->host, host, name_len);
+    client->host[name_len] = 0;
+
+    if (colon) {
+        size_t port_len = host_len - name_len - 1;
+        if (port_len == 0 || port_len >= sizeof(client->port)) return false;
+        memcpy(client->port, colon + 1, port_len);
+        client->port[port_len] = 0;
+    } else {
+        strlcpy(client->port, "80", sizeof(client->port));
+    }
+    return true;
+}
+
+static void http_close(http_client_t *client) {
+    if (client->sock >= 0) {
+        closesocket(client->sock);
+        client->sock = -1;
+    }
+}
+
+static bool http_open(http_client_t *client) {
+    if (client->sock >= 0) return true; // Reuse the keep-alive connection
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(client->host, client->port, &hints, &res) != 0 || res == NULL) {
+        WARN("DNS lookup failed for %s", client->host);
+        return false;
+    }
+
+    int sock = socket(res->ai_family, res->ai_socktype, 0);
+    if (sock < 0) {
+        freeaddrinfo(res);
+        WARN("Failed to create TCP socket");
+        return false;
+    }
+    struct timeval tv = { .tv_sec = HTTP_IO_TIMEOUT_SEC, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    int err = connect(sock, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (err != 0) {
+        WARN("Connect to %s:%s failed", client->host, client->port);
+        closesocket(sock);
+        return false;
+    }
+    client->sock = sock;
+    client->connects++;
+    return true;
+}
+
+static bool send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static void parse_headers(char *headers, http_response_t *resp) {
+    for (char *line = strstr(headers, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            resp->content_length = strtoul(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Content-Range:", 14) == 0) {
+            unsigned int first = 0, last = 0, total = 0;
+            if (sscanf(line + 14, " bytes %u-%u/%u", &first, &last, &total) == 3) {
+                resp->range_start = first;
+                resp->total_size = total;
+            }
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *value = line + 11;
+            while (*value == ' ') value++;
+            resp->keep_alive = strncasecmp(value, "close", 5) != 0;
+        }
+    }
+}
+
+// Sends a ranged GET and reads the response headers. Any body bytes that arrived
+// together with the headers are returned through body/body_len.
+static bool http_request(http_client_t *client, size_t first, size_t last, http_response_t *resp, const uint8_t **body, size_t *body_len) {
+    char request[256];
+    int n = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%u-%u\r\nConnection: keep-alive\r\n\r\n",
+                     client->path, client->host, (unsigned int)first, (unsigned int)last);
+    if (n <= 0 || n >= (int)sizeof(request)) return false;
+    if (!send_all(client->sock, request, n)) return false;
+    client->requests++;
+
+    size_t len = 0;
+    char *end = NULL;
+    while (end == NULL) {
+        if (len >= sizeof(s_header) - 1) {
+            WARN("Response headers too large");
+            return false;
+        }
+        int r = recv(client->sock, s_header + len, sizeof(s_header) - 1 - len, 0);
+        if (r <= 0) return false;
+        len += r;
+        s_header[len] = 0;
+        end = strstr(s_header, "\r\n\r\n");
+    }
+    *end = 0;
+    size_t header_len = (end + 4) - s_header;
+    *body = (const uint8_t *)s_header + header_len;
+    *body_len = len - header_len;
+
+    int minor = 0;
+    memset(resp, 0, sizeof(*resp));
+    if (sscanf(s_header, "HTTP/1.%d %d", &minor, &resp->status) != 2) return false;
+    resp->keep_alive = minor >= 1;
+    resp->content_length = SIZE_MAX;
+    parse_headers(s_header, resp);
+
+    if (resp->content_length == SIZE_MAX) {
+        WARN("Response without Content-Length is not supported");
+        return false;
+    }
+    if (resp->status == 200) resp->total_size = resp->content_length;
+    return true;
+}
+
+// Streams `remaining` body bytes into the processor, dropping the first `skip` bytes
+// (a server that ignores Range resends the image from offset 0).
+static bool http_read_body(http_client_t *client, size_t remaining, size_t skip, const uint8_t *data, size_t len, OtaProcessor &processor, const bool &proc_error) {
+    while (true) {
+        if (len > remaining) len = remaining;
+        remaining -= len;
+        if (skip > 0) {
+            size_t n = skip < len ? skip : len;
+            skip -= n;
+            data += n;
+            len -= n;
+        }
+        if (len > 0) {
+            processor.process(data, len);
+            if (proc_error || processor.isRebootRequired()) return true;
+        }
+        if (remaining == 0) return true;
+
+        int r = recv(client->sock, s_rx_buffer, sizeof(s_rx_buffer), 0);
+        if (r <= 0) return false;
+        data = s_rx_buffer;
+        len = r;
+    }
+}
+
+static bool pull_image(const nvs_config_t *config, OtaProcessor &otaProcessor) {
+    http_client_t client;
+    memset(&client, 0, sizeof(client));
+    client.sock = -1;
+    if (!parse_url(config->url, &client)) {
+        WARN("Unsupported image URL: %s", config->url);
+        return false;
+    }
+    INFO("Pulling image from %s:%s%s", client.host, client.port, client.path);
+
+    bool proc_error = false;
+    otaProcessor.reset();
+    otaProcessor.setNvramExpectedHash(config->ota_hash);
+    // Responses have no peer to go to. Only errors matter: they end the pull.
+    otaProcessor.setSender([&proc_error](const char* data, size_t len) {
+        if (len >= 3 && strncmp(data, "ERR", 3) == 0) {
+            proc_error = true;
+            WARN("Processor: %.*s", (int)len, data);
+        }
+    });
+
+    size_t total = 0; // Unknown until the first response
+    int failures = 0;
+    uint32_t start_ms = esp_log_timestamp();
+
+    while (!otaProcessor.isRebootRequired()) {
+        if (failures > 0) {
+            http_close(&client);
+            if (failures > HTTP_MAX_RETRIES) {
+                WARN("Giving up after %d failed requests", failures - 1);
+                return false;
+            }
+            vTaskDelay(HTTP_RETRY_DELAY_MS / portTICK_PERIOD_MS);
+        }
+
+        // Always resume from the last byte the processor accepted
+        size_t offset = otaProcessor.bytesReceived();
+        size_t end = offset + HTTP_RANGE_SIZE;
+        if (total > 0 && end > total) end = total;
+
+        http_response_t resp;
+        const uint8_t *body = NULL;
+        size_t body_len = 0;
+        if (!http_open(&client) || !http_request(&client, offset, end - 1, &resp, &body, &body_len)) {
+            failures++;
+            INFO("Request for offset %u failed (attempt %d)", (unsigned int)offset, failures);
+            continue;
+        }
+
+        size_t skip = 0;
+        if (resp.status == 200) {
+            skip = offset;
+        } else if (resp.status != 206 || resp.range_start != offset) {
+            WARN("Unexpected response: HTTP %d", resp.status);
+            failures++;
+            continue;
+        }
+
+        if (total == 0) {
+            total = resp.total_size;
+            if (total == 0) {
+                WARN("Server did not report the image size");
+                http_close(&client);
+                return false;
+            }
+            char hash_hex[65];
+            char cmd[96];
+            hash_to_hex(config->ota_hash, hash_hex);
+            int n = snprintf(cmd, sizeof(cmd), "OTA %u %s\n", (unsigned int)total, hash_hex);
+            otaProcessor.process((const uint8_t *)cmd, n);
+            if (proc_error || !otaProcessor.isDownloading()) {
+                http_close(&client);
+                return false;
+            }
+        } else if (resp.total_size != total) {
+            WARN("Image size changed on the server (%u != %u)", (unsigned int)resp.total_size, (unsigned int)total);
+            http_close(&client);
+            return false;
+        }
+
+        bool complete = http_read_body(&client, resp.content_length, skip, body, body_len, otaProcessor, proc_error);
+        if (proc_error) {
+            http_close(&client);
+            return false;
+        }
+        if (!complete) {
+            // A connection that made progress restarts the retry budget
+            failures = otaProcessor.bytesReceived() > offset ? 1 : failures + 1;
+            INFO("Connection lost at %u / %u", (unsigned int)otaProcessor.bytesReceived(), (unsigned int)total);
+            continue;
+        }
+        if (!resp.keep_alive) http_close(&client);
+        // An empty or discarded body would otherwise re-request the same range forever
+        if (otaProcessor.bytesReceived() > offset) {
+            failures = 0;
+        } else {
+            failures++;
+            INFO("No progress at offset %u (attempt %d)", (unsigned int)offset, failures);
+        }
+    }
+    http_close(&client);
+
+    uint32_t elapsed_ms = esp_log_timestamp() - start_ms;
+    if (elapsed_ms == 0) elapsed_ms = 1;
+    INFO("Pulled %u bytes in %lu ms (%lu B/s, incl. erase), %lu requests over %lu connections",
+         (unsigned int)total, (unsigned long)elapsed_ms, (unsigned long)((uint64_t)total * 1000 / elapsed_ms),
+         client.requests, client.connects);
+    return true;
+}
+
+bool start_http_pull_ota(const nvs_config_t *config) {
+    if (!ota_session_acquire(SESSION_WIFI)) return false;
+    OtaProcessor &otaProcessor = ota_session_processor();
+    if (pull_image(config, otaProcessor)) return true;
+    otaProcessor.reset();
+    ota_session_release(SESSION_WIFI);
+    return false;
+}
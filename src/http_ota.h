@@ -0,0 +1,6 @@
+#pragma once
+#include "nvs_config.h"
+
+// Pulls the image from config->url. Returns true once the new image is flashed,
+// false if the server could not be used (caller falls back to the push listener).
+bool start_http_pull_ota(const nvs_config_t *config);
@@ -7,18 +7,34 @@
 
 // Project Includes
 #include "common_log.h"
+#include "dlog.h"
 #include "nvs_config.h"
 #include "wifi_app.h"
 #include "net_ota.h"
+#include "http_ota.h"
 #include "ble_ota.h"
 #include "utils.h"
+#include "preerase.h"
 #define TAG "MAIN"
 
 #define NO_REBOOT_OTA 0
 #define OTA_BLE 1
 #define OTA_WIFI 2
+#define OTA_BLE_WIFI 3 // Listen on both, first client to connect owns the session
+
+static void run_wifi_ota(const nvs_config_t *config) {
+    // Pull from the configured image server, or wait for a client to push
+    if (config->url[0] == 0 || !start_http_pull_ota(config)) {
+        start_network_ota_process(config);
+    }
+    INFO("Marking NVRAM as updated.");
+    nvs_mark_updated();
+    INFO("Success. Rebooting.");
+    esp_restart();
+}
 
 extern "C" void app_main(void) {
+    dlog_start();
 
     esp_netif_init();
     esp_event_loop_create_default();
@@ -32,15 +48,23 @@ extern "C" void app_main(void) {
     nvs_read_config(&config);
 
     print_hash("Expecting firmware with hash: ", config.ota_hash);
+    // Overlaps the erase with WiFi association / BLE advertising
+    preerase_start(config.ota_size);
     if (config.method == OTA_WIFI) {
         INFO("Mode: WiFi OTA");
         INFO("Connecting to SSID: %s", config.ssid);
-        wifi_connect(&config);
-        start_network_ota_process(&config);
-        INFO("Marking NVRAM as updated.");
-        nvs_mark_updated();
-        INFO("Success. Rebooting.");
-        esp_restart();
+        if (!wifi_connect(&config)) FAIL("Failed to connect to WiFi");
+        run_wifi_ota(&config);
+    } else if (config.method == OTA_BLE_WIFI) {
+        INFO("Mode: BLE + WiFi OTA");
+        xTaskCreate(ble_ota_task, "ble_ota_task", 8192, NULL, 5, NULL);
+        INFO("Connecting to SSID: %s", config.ssid);
+        // An unreachable network is not fatal here, BLE keeps advertising
+        if (wifi_connect(&config)) {
+            run_wifi_ota(&config);
+        } else {
+            INFO("Continuing with BLE only");
+        }
     } else {
         INFO("Mode: BLE OTA");
         
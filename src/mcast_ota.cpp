@@ -0,0 +1,265 @@
+#include "mcast_ota.h"
+#include "common_log.h"
+#include "dlog.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_random.h"
+#include "esp_wifi.h"
+#include "lwip/sockets.h"
+#include <cstring>
+#include <cstdlib>
+#include "utils.h"
+#include "ota_session.h"
+
+#define TAG "MCAST_OTA"
+#define OTA_PORT 3232
+#define MCAST_GROUP "239.255.32.32"
+#define MCAST_MAGIC "MOTA"
+#define MCAST_MAX_BLOCK 1024
+#define MCAST_MAX_RANGES 64              // Missing ranges reported per NACK
+#define MCAST_NACK_MIN_INTERVAL_MS 500   // Rate limit per device
+#define MCAST_NACK_JITTER_MS 250         // Spreads a fleet's NACKs out after each END
+#define MCAST_NACK_IDLE_MS 2000          // NACK unprompted if the sender goes quiet
+#define MCAST_SESSION_TIMEOUT_MS 30000   // Abandon the session after this long without packets
+#define MCAST_DONE_REPEATS 3
+#define MCAST_DONE_INTERVAL_MS 100       // Between repeats, and before the reboot cuts WiFi
+
+enum {
+    MCAST_ANNOUNCE = 1, // Sender -> group: image size, block size, hash
+    MCAST_DATA = 2,     // Sender -> group: one numbered block
+    MCAST_END = 3,      // Sender -> group: end of a pass, report what is missing
+    MCAST_NACK = 4,     // Device -> sender: list of missing block ranges
+    MCAST_DONE = 5,     // Device -> sender: image complete and verified
+};
+
+// All fields in network byte order
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t len;      // Payload bytes after the header
+    uint32_t session;
+    uint32_t index;    // Block number for DATA
+} mcast_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t image_size;
+    uint16_t block_size;
+    uint16_t reserved;
+    uint8_t hash[32];
+} mcast_announce_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t first;
+    uint32_t count;
+} mcast_range_t;
+
+// Kept off the main task stack, which also holds the TCP listener's receive buffer.
+static uint8_t s_packet[sizeof(mcast_hdr_t) + MCAST_MAX_BLOCK];
+static uint8_t s_send_packet[sizeof(mcast_hdr_t) + MCAST_MAX_RANGES * sizeof(mcast_range_t)];
+static mcast_range_t s_ranges[MCAST_MAX_RANGES];
+
+int mcast_ota_open() {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) return -1;
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(OTA_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        closesocket(sock);
+        return -1;
+    }
+
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(MCAST_GROUP);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        closesocket(sock);
+        return -1;
+    }
+    INFO("Joined multicast group %s:%d", MCAST_GROUP, OTA_PORT);
+    return sock;
+}
+
+// Returns the payload length, or -1 if the datagram is not ours
+static int recv_packet(int sock, mcast_hdr_t **hdr, struct sockaddr_in *from) {
+    socklen_t from_len = sizeof(*from);
+    int len = recvfrom(sock, s_packet, sizeof(s_packet), 0, (struct sockaddr *)from, &from_len);
+    if (len < (int)sizeof(mcast_hdr_t)) return -1;
+    *hdr = (mcast_hdr_t *)s_packet;
+    if (memcmp((*hdr)->magic, MCAST_MAGIC, 4) != 0) return -1;
+    int payload = ntohs((*hdr)->len);
+    if (payload > len - (int)sizeof(mcast_hdr_t)) return -1;
+    return payload;
+}
+
+static void send_packet(int sock, const struct sockaddr_in *to, uint8_t type, uint32_t session, const void *payload, size_t len) {
+    uint8_t *buf = s_send_packet;
+    mcast_hdr_t *hdr = (mcast_hdr_t *)buf;
+    memcpy(hdr->magic, MCAST_MAGIC, 4);
+    hdr->type = type;
+    hdr->reserved = 0;
+    hdr->len = htons(len);
+    hdr->session = htonl(session);
+    hdr->index = 0;
+    if (len > 0) memcpy(buf + sizeof(mcast_hdr_t), payload, len);
+    sendto(sock, buf, sizeof(mcast_hdr_t) + len, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+static bool bit_get(const uint8_t *bitmap, uint32_t i) {
+    return bitmap[i / 8] & (1 << (i % 8));
+}
+
+static void send_nack(int sock, const struct sockaddr_in *to, uint32_t session, const uint8_t *bitmap, uint32_t blocks) {
+    mcast_range_t *ranges = s_ranges;
+    int count = 0;
+    uint32_t i = 0;
+    while (i < blocks && count < MCAST_MAX_RANGES) {
+        if (bit_get(bitmap, i)) {
+            i++;
+            continue;
+        }
+        uint32_t first = i;
+        while (i < blocks && !bit_get(bitmap, i)) i++;
+        ranges[count].first = htonl(first);
+        ranges[count].count = htonl(i - first);
+        count++;
+    }
+    send_packet(sock, to, MCAST_NACK, session, ranges, count * sizeof(mcast_range_t));
+}
+
+static bool run_session(int sock, OtaProcessor &processor, uint32_t session, const mcast_announce_t *announce, const struct sockaddr_in *sender) {
+    uint32_t image_size = ntohl(announce->image_size);
+    uint16_t block_size = ntohs(announce->block_size);
+    // Block 0 must hold the whole image header, or writeAt() rejects it after the erase
+    if (block_size < sizeof(esp_image_header_t) || block_size > MCAST_MAX_BLOCK) {
+        WARN("Unsupported block size %u", block_size);
+        return false;
+    }
+
+    bool proc_error = false;
+    processor.reset();
+    processor.setSender([&proc_error](const char* data, size_t len) {
+        if (len >= 3 && strncmp(data, "ERR", 3) == 0) {
+            proc_error = true;
+            WARN("Processor: %.*s", (int)len, data);
+        }
+    });
+
+    // Same handshake as the push transports: the processor checks the hash against NVS and erases
+    char hash_hex[65];
+    char cmd[96];
+    hash_to_hex(announce->hash, hash_hex);
+    int n = snprintf(cmd, sizeof(cmd), "OTA %lu %s\n", (unsigned long)image_size, hash_hex);
+    processor.process((const uint8_t *)cmd, n);
+    if (proc_error || !processor.isDownloading()) {
+        processor.reset();
+        return false;
+    }
+
+    uint32_t blocks = (image_size + block_size - 1) / block_size;
+    uint8_t *bitmap = (uint8_t *)calloc((blocks + 7) / 8, 1);
+    if (!bitmap) {
+        WARN("Out of memory for %lu block bitmap", (unsigned long)blocks);
+        processor.reset();
+        return false;
+    }
+    INFO("Session %08lx: %lu bytes in %lu blocks from %s", (unsigned long)session, (unsigned long)image_size,
+         (unsigned long)blocks, inet_ntoa(sender->sin_addr));
+
+    // Power save makes the AP hold multicast frames until DTIM, which drops most of a burst
+    esp_wifi_set_ps(WIFI_PS_NONE);
+
+    uint32_t received = 0;
+    uint32_t last_rx = esp_log_timestamp();
+    uint32_t last_nack = last_rx - MCAST_NACK_MIN_INTERVAL_MS;
+    uint32_t nack_at = 0;
+    bool nack_due = false;
+
+    while (received < blocks && !proc_error) {
+        uint32_t now = esp_log_timestamp();
+        if (now - last_rx > MCAST_SESSION_TIMEOUT_MS) {
+            WARN("Session timed out with %lu / %lu blocks", (unsigned long)received, (unsigned long)blocks);
+            break;
+        }
+        if (!nack_due && now - last_rx > MCAST_NACK_IDLE_MS && now - last_nack > MCAST_NACK_IDLE_MS) {
+            nack_due = true;
+            nack_at = now;
+        }
+        if (nack_due && (int32_t)(now - nack_at) >= 0) {
+            send_nack(sock, sender, session, bitmap, blocks);
+            last_nack = now;
+            nack_due = false;
+        }
+
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(sock, &readfds);
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+        if (select(sock + 1, &readfds, NULL, NULL, &tv) <= 0) continue;
+
+        mcast_hdr_t *hdr;
+        struct sockaddr_in from;
+        int len = recv_packet(sock, &hdr, &from);
+        if (len < 0 || ntohl(hdr->session) != session) continue;
+        last_rx = esp_log_timestamp();
+
+        if (hdr->type == MCAST_END) {
+            if (!nack_due) {
+                // Random delay so a fleet does not answer the same END at once, but never
+                // sooner than the per-device rate limit allows
+                nack_at = last_rx + esp_random() % MCAST_NACK_JITTER_MS;
+                uint32_t earliest = last_nack + MCAST_NACK_MIN_INTERVAL_MS;
+                if ((int32_t)(earliest - nack_at) > 0) nack_at = earliest;
+                nack_due = true;
+            }
+        } else if (hdr->type == MCAST_DATA) {
+            uint32_t index = ntohl(hdr->index);
+            if (index >= blocks || bit_get(bitmap, index)) continue; // Repairs others asked for
+            uint32_t expected = image_size - index * block_size;
+            if (expected > block_size) expected = block_size;
+            if ((uint32_t)len != expected) continue;
+            if (!processor.writeAt((size_t)index * block_size, s_packet + sizeof(mcast_hdr_t), len)) break;
+            bitmap[index / 8] |= 1 << (index % 8);
+            received++;
+            if (received % 64 == 0) DINFO("Progress: %lu / %lu blocks", (unsigned long)received, (unsigned long)blocks);
+        }
+    }
+    free(bitmap);
+
+    if (received == blocks && !proc_error) {
+        processor.finishFromFlash();
+    }
+    if (processor.isRebootRequired()) {
+        // DONE is not acknowledged, so repeat it in case one is lost. Spaced out so one burst of
+        // interference cannot take all of them, and the last gets time to leave the driver.
+        for (int i = 0; i < MCAST_DONE_REPEATS; i++) {
+            send_packet(sock, sender, MCAST_DONE, session, NULL, 0);
+            vTaskDelay(MCAST_DONE_INTERVAL_MS / portTICK_PERIOD_MS);
+        }
+        return true;
+    }
+    processor.reset();
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+    return false;
+}
+
+bool mcast_ota_poll(int sock, OtaProcessor &processor) {
+    mcast_hdr_t *hdr;
+    struct sockaddr_in from;
+    int len = recv_packet(sock, &hdr, &from);
+    if (len < (int)sizeof(mcast_announce_t) || hdr->type != MCAST_ANNOUNCE) return false;
+
+    // Copy out of the shared packet buffer before the session reuses it
+    mcast_announce_t announce;
+    memcpy(&announce, s_packet + sizeof(mcast_hdr_t), sizeof(announce));
+    if (!ota_session_acquire(SESSION_WIFI)) return false;
+    if (run_session(sock, processor, ntohl(hdr->session), &announce, &from)) return true;
+    ota_session_release(SESSION_WIFI);
+    return false;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "ota_processor.h"
+
+// UDP socket on the OTA port joined to the multicast group, or -1.
+int mcast_ota_open();
+
+// Reads one datagram from the multicast socket. If it announces the image pinned in NVS,
+// runs the whole multicast session. Returns true once the new image is flashed.
+bool mcast_ota_poll(int sock, OtaProcessor &processor);
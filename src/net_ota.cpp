@@ -1,6 +1,8 @@
 #include "net_ota.h"
 #include "common_log.h"
 #include "ota_processor.h"
+#include "mcast_ota.h"
+#include "ota_session.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_mac.h"
@@ -11,6 +13,28 @@
 #define TAG "NET_OTA"
 #define OTA_PORT 3232
 #define BROADCAST_INTERVAL_SEC 1
+#define REBOOT_FLUSH_TIMEOUT_MS 2000
+
+// Sends FIN after any queued data and waits for the client to close its side,
+// which means it has read the final response. Returns false on timeout.
+static bool drain_and_close(int sock, uint32_t timeout_ms) {
+    shutdown(sock, SHUT_WR);
+    uint32_t deadline = esp_log_timestamp() + timeout_ms;
+    uint8_t discard[64];
+    bool closed = false;
+    while (!closed) {
+        int32_t remaining = (int32_t)(deadline - esp_log_timestamp());
+        if (remaining <= 0) break;
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(sock, &readfds);
+        struct timeval tv = { .tv_sec = remaining / 1000, .tv_usec = (remaining % 1000) * 1000 };
+        if (select(sock + 1, &readfds, NULL, NULL, &tv) <= 0) break;
+        closed = recv(sock, discard, sizeof(discard), 0) <= 0;
+    }
+    closesocket(sock);
+    return closed;
+}
 
 void start_network_ota_process(const nvs_config_t *config) {
     INFO("Starting Network Listener...");
@@ -46,7 +70,12 @@ void start_network_ota_process(const nvs_config_t *config) {
 
     INFO("Listening on TCP port %d", OTA_PORT);
 
-    OtaProcessor otaProcessor;
+    // One-to-many updates arrive on the same port; unicast still works if the join fails
+    int mcast_sock = mcast_ota_open();
+    if (mcast_sock < 0) WARN("Multicast OTA unavailable");
+    ota_session_mark_ready(SESSION_WIFI);
+
+    OtaProcessor &otaProcessor = ota_session_processor();
     uint8_t rx_buffer[1024];
 
     // Set the expencted hash from the NVS
@@ -64,15 +93,34 @@ void start_network_ota_process(const nvs_config_t *config) {
             fd_set readfds;
             FD_ZERO(&readfds);
             FD_SET(listen_sock, &readfds);
+            if (mcast_sock >= 0) FD_SET(mcast_sock, &readfds);
+            int max_sock = mcast_sock > listen_sock ? mcast_sock : listen_sock;
             struct timeval tv = { .tv_sec = BROADCAST_INTERVAL_SEC, .tv_usec = 0 };
-            int activity = select(listen_sock + 1, &readfds, NULL, NULL, &tv);
+            int activity = select(max_sock + 1, &readfds, NULL, NULL, &tv);
+            if (activity > 0 && mcast_sock >= 0 && FD_ISSET(mcast_sock, &readfds)) {
+                if (mcast_ota_poll(mcast_sock, otaProcessor)) {
+                    INFO("Multicast update complete. Restarting.");
+                    esp_restart();
+                }
+            }
             if (activity > 0 && FD_ISSET(listen_sock, &readfds)) {
                 client_sock = accept(listen_sock, (struct sockaddr *)&client_addr, &client_addr_len);
                 if (client_sock >= 0) INFO("Client connected from %s", inet_ntoa(client_addr.sin_addr));
+                // BLE may already be updating the device
+                if (client_sock >= 0 && !ota_session_acquire(SESSION_WIFI)) {
+                    send(client_sock, "ERR Busy\n", 9, 0);
+                    closesocket(client_sock);
+                    client_sock = -1;
+                }
             }
             vTaskDelay(10 / portTICK_PERIOD_MS);
         }
 
+        // No flusher: send() only hands the response to lwIP, and the socket API cannot tell
+        // when the peer has it. Nagle off at least keeps lwIP from holding it back for coalescing.
+        int nodelay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
         otaProcessor.reset();
         otaProcessor.setSender([client_sock](const char* data, size_t len) {
             send(client_sock, data, len, 0);
@@ -89,13 +137,17 @@ void start_network_ota_process(const nvs_config_t *config) {
             // Check for reboot request inside the loop or after recv returns
             // Note: process() is synchronous here.
             if (otaProcessor.isRebootRequired()) {
-                INFO("Reboot flag detected. Restarting in 2 seconds...");
-                vTaskDelay(2000 / portTICK_PERIOD_MS); // Wait for ACK flush
+                INFO("Reboot flag detected. Flushing final response...");
+                if (!drain_and_close(client_sock, REBOOT_FLUSH_TIMEOUT_MS)) {
+                    WARN("Client did not close, rebooting anyway");
+                }
+                INFO("Restarting.");
                 esp_restart();
             }
         }
 
         closesocket(client_sock);
         otaProcessor.reset();
+        ota_session_release(SESSION_WIFI);
     }
 }
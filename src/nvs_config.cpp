@@ -20,14 +20,19 @@ void nvs_read_config(nvs_config_t *config) {
     size_t ssid_len = sizeof(config->ssid);
     size_t psk_len = sizeof(config->psk);
     size_t hash_len = sizeof(config->ota_hash);
+    size_t url_len = sizeof(config->url);
     config->method = 0; 
     memset(config->ssid, 0, 32);
     memset(config->psk, 0, 64);
+    memset(config->url, 0, sizeof(config->url));
+    config->ota_size = 0;
 
     if(nvs_get_u8(s_nvs_handle, "method", &config->method) != ESP_OK) INFO("No method found");
     nvs_get_str(s_nvs_handle, "ssid", config->ssid, &ssid_len);
     nvs_get_str(s_nvs_handle, "psk", config->psk, &psk_len);
     nvs_get_blob(s_nvs_handle, "ota_hash", config->ota_hash, &hash_len);
+    nvs_get_str(s_nvs_handle, "ota_url", config->url, &url_len);
+    nvs_get_u32(s_nvs_handle, "ota_size", &config->ota_size);
     nvs_set_u8(s_nvs_handle, "updated", 0);
     nvs_commit(s_nvs_handle);
 }
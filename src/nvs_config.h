@@ -8,6 +8,8 @@ typedef struct {
     char ssid[32];
     char psk[64];
     uint8_t ota_hash[32];
+    char url[128];
+    uint32_t ota_size; // Expected image size, 0 if unknown
 } nvs_config_t;
 
 void nvs_init_custom(const char *nvs_namespace);
@@ -1,9 +1,12 @@
 #include "ota_processor.h"
 #include "common_log.h"
+#include "dlog.h"
 #include "nvs_config.h"
 #include "utils.h"
+#include "preerase.h"
 #include "esp_mac.h"
 #include "esp_system.h"
+#include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include <cstring>
@@ -15,8 +18,9 @@
 #define RESP_OK "OK\n"
 #define RESP_ERR "ERR\n"
 #define RESP_ACK "ACK" // No newline needed for BLE packets usually, but keeps it simple
+#define ERASE_FLUSH_TIMEOUT_MS 500
 
-OtaProcessor::OtaProcessor() : _state(STATE_IDLE), _sender(nullptr), _reboot_required(false), _ack_enabled(false) {
+OtaProcessor::OtaProcessor() : _state(STATE_IDLE), _sender(nullptr), _flusher(nullptr), _reboot_required(false), _ack_enabled(false), _flow_enabled(false), _pre_erased(false) {
     reset();
 }
 
@@ -28,6 +32,16 @@ void OtaProcessor::setSender(ota_sender_t sender) {
     _sender = sender;
 }
 
+void OtaProcessor::setFlusher(ota_flusher_t flusher) {
+    _flusher = flusher;
+}
+
+// Transports without a flusher hand responses off synchronously, so there is nothing to wait for.
+bool OtaProcessor::flush(uint32_t timeout_ms) {
+    if (!_flusher) return true;
+    return _flusher(timeout_ms);
+}
+
 void OtaProcessor::setNvramExpectedHash(const uint8_t* hash) {
     memcpy(_nvs_expected_hash, hash, 32);
     _has_nvs_hash = true;
@@ -35,6 +49,16 @@ void OtaProcessor::setNvramExpectedHash(const uint8_t* hash) {
 
 void OtaProcessor::setAckEnabled(bool enabled) {
     _ack_enabled = enabled;
+    _flow_enabled = false;
+}
+
+bool OtaProcessor::isFlowEnabled() const {
+    return _flow_enabled;
+}
+
+void OtaProcessor::sendFlowHint(size_t chunk, size_t inflight) {
+    if (!_flow_enabled) return;
+    sendResponse("FC %u %u\n", (unsigned int)chunk, (unsigned int)inflight);
 }
 
 void OtaProcessor::reset() {
@@ -50,11 +74,21 @@ bool OtaProcessor::isRebootRequired() const {
     return _reboot_required;
 }
 
+bool OtaProcessor::isDownloading() const {
+    return _state == STATE_DOWNLOADING;
+}
+
+// Bytes written to flash so far. Pull transports resume from this offset.
+size_t OtaProcessor::bytesReceived() const {
+    return _total_received;
+}
+
 void OtaProcessor::cleanup(bool success) {
     if (_ota_handle) {
         if (!success) esp_ota_abort(_ota_handle);
         _ota_handle = 0;
     }
+    _pre_erased = false;
     mbedtls_sha256_free(&_sha_ctx);
     _firmware_size = 0;
     _total_received = 0;
@@ -102,6 +136,8 @@ void OtaProcessor::handleCommand() {
         handleVersion();
     } else if (strncmp(_cmd_buffer, "REBOOT", 6) == 0) {
         handleReboot();
+    } else if (strncmp(_cmd_buffer, "FLOW", 4) == 0) {
+        handleFlow();
     } else if (strncmp(_cmd_buffer, "OTA", 3) == 0) {
         handleOtaStart(_cmd_buffer + 3);
     } else {
@@ -125,6 +161,16 @@ void OtaProcessor::handleReboot() {
     _reboot_required = true;
 }
 
+void OtaProcessor::handleFlow() {
+    // Hints only make sense where chunks are ACKed; TCP paces itself
+    if (!_ack_enabled) {
+        sendResponse("ERR Not Supported\n");
+        return;
+    }
+    _flow_enabled = true;
+    sendResponse(RESP_OK);
+}
+
 static bool hash_string_to_bytes(const char *hex, uint8_t *bytes) {
     for (int i = 0; i < 32; ++i) {
         unsigned int byte = 0;
@@ -169,42 +215,150 @@ void OtaProcessor::handleOtaStart(const char* args) {
         return;
     }
 
+    // Reject impossible sizes before the erase, not after the transfer
+    if (_firmware_size < sizeof(esp_image_header_t)) {
+        sendResponse("ERR Image Too Small\n");
+        return;
+    }
+    if (_firmware_size > _target_partition->size) {
+        INFO("Image size %u exceeds partition size %lu", (unsigned int)_firmware_size, (unsigned long)_target_partition->size);
+        sendResponse("ERR Image Too Large\n");
+        return;
+    }
+
     const esp_partition_t *running = esp_ota_get_running_partition();
     esp_ota_set_boot_partition(running); 
 
 
-    // 1. Notify Client that we are about to block
+    // 1. Notify Client that we are about to block (still sent when pre-erased, clients expect it)
     sendResponse("ERASING"); 
-    // 2. Yield to FreeRTOS to ensure the "ERASING" packet 
-    // actually gets pushed to the BLE/TCP hardware buffer before we block the CPU.
-    vTaskDelay(50 / portTICK_PERIOD_MS); 
+    // 2. Let the transport hand "ERASING" to its lower layer before we block the CPU.
+    // Neither transport can confirm it left the device: BLE's flusher returns once the
+    // host has queued the notification, and TCP has no flusher.
+    if (!flush(ERASE_FLUSH_TIMEOUT_MS)) {
+        WARN("ERASING not confirmed sent, erasing anyway");
+    }
 
     INFO("Starting OTA. Size: %u, Part: 0x%lx", (unsigned int)_firmware_size, _target_partition->address);
 
-
-    if (esp_ota_begin(_target_partition, _firmware_size, &_ota_handle) != ESP_OK) {
-        sendResponse("ERR OTA Begin Failed\n");
-        return;
+    // 3. Skip the erase if the background pre-erase already covered the image
+    if (preerase_take(_target_partition, _firmware_size)) {
+        INFO("Partition already erased");
+        _pre_erased = true;
+    } else {
+        if (esp_ota_begin(_target_partition, _firmware_size, &_ota_handle) != ESP_OK) {
+            sendResponse("ERR OTA Begin Failed\n");
+            return;
+        }
     }
 
     mbedtls_sha256_init(&_sha_ctx);
     mbedtls_sha256_starts(&_sha_ctx, 0); 
 
+    _parse_at = 0;
+    _parse_need = sizeof(esp_image_header_t);
+    _parse_len = 0;
+    _segments_left = -1;
+    _hash_appended = false;
+    _image_checked = false;
+
     _state = STATE_DOWNLOADING;
     _total_received = 0;
     sendResponse(RESP_OK);
 }
 
+// Returns an error response if the image header cannot belong to a bootable image for this chip
+static const char* checkImageHeader(const esp_image_header_t* hdr) {
+    if (hdr->magic != ESP_IMAGE_HEADER_MAGIC) return "ERR Bad Magic\n";
+    if (hdr->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) return "ERR Wrong Chip\n";
+    if (hdr->segment_count == 0 || hdr->segment_count > ESP_IMAGE_MAX_SEGMENTS) return "ERR Bad Segment Count\n";
+    return nullptr;
+}
+
+const char* OtaProcessor::parseImageHeader() {
+    const esp_image_header_t* hdr = (const esp_image_header_t*)_parse_buf;
+    const char* err = checkImageHeader(hdr);
+    if (err) {
+        DWARN("Image header rejected: magic 0x%02x, chip %u, %u segments", hdr->magic, hdr->chip_id, hdr->segment_count);
+        return err;
+    }
+    _segments_left = hdr->segment_count;
+    _hash_appended = hdr->hash_appended == 1;
+    _parse_at = sizeof(esp_image_header_t);
+    _parse_need = sizeof(esp_image_segment_header_t);
+    _parse_len = 0;
+    return nullptr;
+}
+
+const char* OtaProcessor::parseSegmentHeader() {
+    const esp_image_segment_header_t* seg = (const esp_image_segment_header_t*)_parse_buf;
+    // data_len comes from the upload: compare against the room left instead of adding, which could wrap
+    size_t room = _firmware_size - _parse_at - sizeof(esp_image_segment_header_t);
+    if (_parse_at + sizeof(esp_image_segment_header_t) > _firmware_size || seg->data_len > room) {
+        DWARN("Segment at %u (%u bytes) runs past the declared size", (unsigned int)_parse_at, (unsigned int)seg->data_len);
+        return "ERR Truncated Image\n";
+    }
+    size_t next = _parse_at + sizeof(esp_image_segment_header_t) + seg->data_len;
+    _parse_at = next;
+    _parse_len = 0;
+    if (--_segments_left > 0) return nullptr;
+
+    // After the last segment: padding to 16 bytes ending in a checksum byte, then the optional SHA-256
+    size_t image_len = (next + 16) & ~(size_t)15;
+    if (_hash_appended) image_len += 32;
+    if (image_len > _firmware_size) {
+        DWARN("Image needs %u bytes, declared %u", (unsigned int)image_len, (unsigned int)_firmware_size);
+        return "ERR Truncated Image\n";
+    }
+    _image_checked = true;
+    return nullptr;
+}
+
+// Walks the image header and segment table as the bytes stream past, before they are written.
+// Only the headers are buffered; segment data is skipped.
+bool OtaProcessor::checkImage(const uint8_t* data, size_t len) {
+    size_t start = _total_received;
+    size_t end = start + len;
+    while (!_image_checked) {
+        size_t at = _parse_at + _parse_len;
+        if (at >= end) break; // Rest of this header arrives in a later chunk
+        if (at < start) {
+            // The parse position only moves forward; anything else would read before the chunk
+            DWARN("Image parser at %u, behind chunk at %u", (unsigned int)at, (unsigned int)start);
+            sendResponse("ERR Truncated Image\n");
+            reset();
+            return false;
+        }
+        size_t n = _parse_need - _parse_len;
+        if (n > end - at) n = end - at;
+        memcpy(_parse_buf + _parse_len, data + (at - start), n);
+        _parse_len += n;
+        if (_parse_len < _parse_need) break;
+
+        const char* err = _segments_left < 0 ? parseImageHeader() : parseSegmentHeader();
+        if (err) {
+            sendResponse(err);
+            reset();
+            return false;
+        }
+    }
+    return true;
+}
+
 void OtaProcessor::handleBinaryChunk(const uint8_t* data, size_t len) {
+    if (!checkImage(data, len)) return;
+
     if (mbedtls_sha256_update(&_sha_ctx, data, len) != 0) {
-        INFO("Hash update failed");
+        DWARN("Hash update failed");
         sendResponse("ERR Hash Update\n");
         reset();
         return;
     }
 
-    if (esp_ota_write(_ota_handle, data, len) != ESP_OK) {
-        INFO("Flash write failed");
+    esp_err_t err = _pre_erased ? esp_partition_write(_target_partition, _total_received, data, len)
+                                : esp_ota_write(_ota_handle, data, len);
+    if (err != ESP_OK) {
+        DWARN("Flash write failed (%d)", err);
         sendResponse("ERR Flash Write\n");
         reset();
         return;
@@ -213,12 +367,12 @@ void OtaProcessor::handleBinaryChunk(const uint8_t* data, size_t len) {
     _total_received += len;
 
     if (_total_received % 65536 == 0 || _total_received == _firmware_size) {
-        INFO("Progress: %u / %u", (unsigned int)_total_received, (unsigned int)_firmware_size);
+        DINFO("Progress: %u / %u", (unsigned int)_total_received, (unsigned int)_firmware_size);
     }
 
     if (_total_received >= _firmware_size) {
         if (_total_received > _firmware_size) {
-            INFO("Received too much data!");
+            DWARN("Received too much data!");
             sendResponse("ERR Size Mismatch\n");
             reset();
         } else {
@@ -233,6 +387,76 @@ void OtaProcessor::handleBinaryChunk(const uint8_t* data, size_t len) {
     }
 }
 
+bool OtaProcessor::writeFlash(size_t offset, const uint8_t* data, size_t len) {
+    // With an OTA handle, every block goes through it so the handle's checks apply
+    // (e.g. 16-byte alignment under flash encryption). esp_ota_begin() already erased the partition.
+    if (!_pre_erased) {
+        esp_err_t err = esp_ota_write_with_offset(_ota_handle, data, len, offset);
+        if (err != ESP_OK) DWARN("esp_ota_write_with_offset failed (%d)", err);
+        return err == ESP_OK;
+    }
+    // Pre-erased ahead of time: there is no handle, write the partition directly
+    return esp_partition_write(_target_partition, offset, data, len) == ESP_OK;
+}
+
+bool OtaProcessor::writeAt(size_t offset, const uint8_t* data, size_t len) {
+    if (_state != STATE_DOWNLOADING) return false;
+
+    if (offset + len > _firmware_size) {
+        DWARN("Block outside image: %u + %u", (unsigned int)offset, (unsigned int)len);
+        sendResponse("ERR Size Mismatch\n");
+        reset();
+        return false;
+    }
+
+    // Out of order, the segment table cannot be walked; the image header can still be checked
+    if (offset == 0) {
+        const char* err = len >= sizeof(esp_image_header_t) ? checkImageHeader((const esp_image_header_t*)data) : "ERR Image Too Small\n";
+        if (err) {
+            sendResponse(err);
+            reset();
+            return false;
+        }
+    }
+
+    if (!writeFlash(offset, data, len)) {
+        DWARN("Flash write failed at %u", (unsigned int)offset);
+        sendResponse("ERR Flash Write\n");
+        reset();
+        return false;
+    }
+
+    _total_received += len;
+    return true;
+}
+
+void OtaProcessor::finishFromFlash() {
+    if (_state != STATE_DOWNLOADING) return;
+
+    if (_total_received != _firmware_size) {
+        INFO("Incomplete image: %u / %u", (unsigned int)_total_received, (unsigned int)_firmware_size);
+        sendResponse("ERR Size Mismatch\n");
+        reset();
+        return;
+    }
+
+    // Blocks arrived out of order, so hash what actually landed in flash.
+    // Static: this runs on the main task, and endOta() validates the image below it.
+    static uint8_t s_readback[512];
+    for (size_t offset = 0; offset < _firmware_size; offset += sizeof(s_readback)) {
+        size_t len = _firmware_size - offset;
+        if (len > sizeof(s_readback)) len = sizeof(s_readback);
+        if (esp_partition_read(_target_partition, offset, s_readback, len) != ESP_OK ||
+            mbedtls_sha256_update(&_sha_ctx, s_readback, len) != 0) {
+            INFO("Flash read-back failed");
+            sendResponse("ERR Hash Update\n");
+            reset();
+            return;
+        }
+    }
+    endOta();
+}
+
 void OtaProcessor::endOta() {
     uint8_t calculated_hash[32];
     mbedtls_sha256_finish(&_sha_ctx, calculated_hash);
@@ -250,7 +474,8 @@ void OtaProcessor::endOta() {
         return;
     }
 
-    if (esp_ota_end(_ota_handle) != ESP_OK) {
+    // Without a handle there is nothing to end; esp_ota_set_boot_partition() still verifies the image
+    if (!_pre_erased && esp_ota_end(_ota_handle) != ESP_OK) {
         INFO("OTA End failed");
         sendResponse("ERR OTA End\n");
         reset();
@@ -4,10 +4,14 @@
 #include <functional>
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
+#include "esp_app_format.h"
 #include "mbedtls/sha256.h"
 
 // Callback type for sending responses (e.g. "OK\n", "ERR...")
 typedef std::function<void(const char* data, size_t len)> ota_sender_t;
+// Callback that blocks until previously sent responses have been handed to the transport's
+// lower layer (not necessarily sent over the air). Returns false on timeout.
+typedef std::function<bool(uint32_t timeout_ms)> ota_flusher_t;
 
 class OtaProcessor {
 public:
@@ -15,14 +19,27 @@ public:
     ~OtaProcessor();
 
     void setSender(ota_sender_t sender);
+    void setFlusher(ota_flusher_t flusher);
+    bool flush(uint32_t timeout_ms);
     void setNvramExpectedHash(const uint8_t* hash);
 
     void process(const uint8_t* data, size_t len);
     void reset();
     bool isRebootRequired() const;
+    bool isDownloading() const;
+    size_t bytesReceived() const;
 
     // NEW: Enable explicit ACKs for binary chunks (For BLE flow control)
+    // Also clears the FLOW opt-in, which is per connection.
     void setAckEnabled(bool enabled);
+    // True once the client sent FLOW: it accepts FC hints next to the ACKs
+    bool isFlowEnabled() const;
+    void sendFlowHint(size_t chunk, size_t inflight);
+
+    // Out-of-order writes for transports that deliver numbered blocks (multicast).
+    // Each byte must be written exactly once; the hash is taken from flash in finishFromFlash().
+    bool writeAt(size_t offset, const uint8_t* data, size_t len);
+    void finishFromFlash();
 
 private:
     enum State {
@@ -32,8 +49,11 @@ private:
 
     State _state;
     ota_sender_t _sender;
+    ota_flusher_t _flusher;
     bool _reboot_required;
     bool _ack_enabled;
+    bool _flow_enabled;
+    bool _pre_erased; // Partition erased ahead of time; written directly, without an esp_ota handle
     
     uint8_t _nvs_expected_hash[32];
     bool _has_nvs_hash;
@@ -42,6 +62,15 @@ private:
     const esp_partition_t* _target_partition;
     size_t _firmware_size;
     size_t _total_received;
+
+    // Streaming image header check: collects _parse_need bytes at stream offset _parse_at
+    uint8_t _parse_buf[sizeof(esp_image_header_t)];
+    size_t _parse_at;
+    size_t _parse_need;
+    size_t _parse_len;
+    int _segments_left;   // -1 until the image header is parsed
+    bool _hash_appended;
+    bool _image_checked;
     uint8_t _expected_hash[32];
     mbedtls_sha256_context _sha_ctx;
 
@@ -51,9 +80,14 @@ private:
     void handleCommand();
     void handleVersion();
     void handleReboot();
+    void handleFlow();
     void handleOtaStart(const char* args);
     void handleBinaryChunk(const uint8_t* data, size_t len);
     void endOta();
+    bool writeFlash(size_t offset, const uint8_t* data, size_t len);
+    bool checkImage(const uint8_t* data, size_t len);
+    const char* parseImageHeader();
+    const char* parseSegmentHeader();
     void cleanup(bool success);
     void sendResponse(const char* fmt, ...);
 };
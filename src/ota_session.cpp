@@ -0,0 +1,56 @@
+#include "ota_session.h"
+#include "common_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TAG "SESSION"
+
+static OtaProcessor s_processor;
+static ota_session_owner_t s_owner = SESSION_NONE;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_ready_ms[3] = {0, 0, 0};
+
+static const char *owner_name(ota_session_owner_t owner) {
+    return owner == SESSION_BLE ? "BLE" : owner == SESSION_WIFI ? "WiFi" : "none";
+}
+
+OtaProcessor &ota_session_processor() {
+    return s_processor;
+}
+
+void ota_session_mark_ready(ota_session_owner_t owner) {
+    s_ready_ms[owner] = esp_log_timestamp();
+    INFO("%s ready %lu ms after boot", owner_name(owner), (unsigned long)s_ready_ms[owner]);
+}
+
+bool ota_session_acquire(ota_session_owner_t owner) {
+    // Called from the NimBLE host task and the network task, so take a spinlock
+    taskENTER_CRITICAL(&s_lock);
+    ota_session_owner_t current = s_owner;
+    if (current == SESSION_NONE) s_owner = owner;
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (current != SESSION_NONE && current != owner) {
+        INFO("%s client rejected, session owned by %s", owner_name(owner), owner_name(current));
+        return false;
+    }
+    if (current == SESSION_NONE) {
+        // Drop the previous owner's transport hooks (BLE ACKs would corrupt a TCP stream)
+        s_processor.setSender(nullptr);
+        s_processor.setFlusher(nullptr);
+        s_processor.setAckEnabled(false);
+        INFO("%s session accepted %lu ms after boot (ready at %lu ms)", owner_name(owner),
+             (unsigned long)esp_log_timestamp(), (unsigned long)s_ready_ms[owner]);
+    }
+    return true;
+}
+
+void ota_session_release(ota_session_owner_t owner) {
+    taskENTER_CRITICAL(&s_lock);
+    if (s_owner == owner) s_owner = SESSION_NONE;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+bool ota_session_owned_by(ota_session_owner_t owner) {
+    return s_owner == owner;
+}
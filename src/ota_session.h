@@ -0,0 +1,16 @@
+#pragma once
+#include "ota_processor.h"
+
+// Transports that can own the single OTA session
+typedef enum { SESSION_NONE = 0, SESSION_BLE = 1, SESSION_WIFI = 2 } ota_session_owner_t;
+
+// The one OtaProcessor shared by every transport. Only the session owner may use it.
+OtaProcessor &ota_session_processor();
+
+// Records when a transport started accepting clients, for the boot-to-session report.
+void ota_session_mark_ready(ota_session_owner_t owner);
+
+// Claims the session for `owner`. Fails while another transport holds it.
+bool ota_session_acquire(ota_session_owner_t owner);
+void ota_session_release(ota_session_owner_t owner);
+bool ota_session_owned_by(ota_session_owner_t owner);
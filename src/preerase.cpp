@@ -0,0 +1,70 @@
+#include "preerase.h"
+#include "common_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_flash_encrypt.h"
+
+#define TAG "PREERASE"
+#define PREERASE_STEP (64 * 1024) // Erase in blocks so NVS and the radio stacks get the flash in between
+#define BIT_DONE BIT0
+
+static EventGroupHandle_t s_events = NULL;
+static const esp_partition_t *s_partition = NULL;
+static size_t s_size = 0;    // Bytes requested
+static size_t s_erased = 0;  // Bytes actually erased, valid once BIT_DONE is set
+
+static void preerase_task(void *param) {
+    uint32_t start_ms = esp_log_timestamp();
+    size_t offset = 0;
+    while (offset < s_size) {
+        size_t len = s_size - offset;
+        if (len > PREERASE_STEP) len = PREERASE_STEP;
+        if (esp_partition_erase_range(s_partition, offset, len) != ESP_OK) {
+            WARN("Erase failed at 0x%x", (unsigned int)offset);
+            break;
+        }
+        offset += len;
+    }
+    s_erased = offset;
+    INFO("Erased %u bytes in %lu ms", (unsigned int)s_erased, (unsigned long)(esp_log_timestamp() - start_ms));
+    xEventGroupSetBits(s_events, BIT_DONE);
+    vTaskDelete(NULL);
+}
+
+void preerase_start(size_t size) {
+    // Encrypted writes need 16-byte alignment, which streamed chunks do not guarantee,
+    // so keep esp_ota_write() (and its own erase) in that case.
+    if (size == 0 || esp_flash_encryption_enabled()) return;
+
+    s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    if (!s_partition || size > s_partition->size) {
+        WARN("Expected size %u does not fit ota_0, not pre-erasing", (unsigned int)size);
+        s_partition = NULL;
+        return;
+    }
+    s_size = (size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+
+    s_events = xEventGroupCreate();
+    if (!s_events) return;
+    // Low priority: this only has to finish before the client's OTA command arrives
+    if (xTaskCreate(preerase_task, "preerase", 2048, NULL, 1, NULL) != pdPASS) {
+        vEventGroupDelete(s_events);
+        s_events = NULL;
+        return;
+    }
+    INFO("Pre-erasing %u bytes of ota_0", (unsigned int)s_size);
+}
+
+bool preerase_take(const esp_partition_t *partition, size_t size) {
+    if (!s_events) return false;
+
+    // Even when the region turns out to be too small, the erase must finish before anyone writes
+    xEventGroupWaitBits(s_events, BIT_DONE, pdFALSE, pdFALSE, portMAX_DELAY);
+    bool usable = partition == s_partition && size <= s_erased;
+    if (!usable) INFO("Pre-erased %u bytes, need %u. Erasing normally.", (unsigned int)s_erased, (unsigned int)size);
+
+    // Whatever happens next writes to the region, so it is never clean again
+    s_erased = 0;
+    return usable;
+}
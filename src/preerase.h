@@ -0,0 +1,10 @@
+#pragma once
+#include <cstddef>
+#include "esp_partition.h"
+
+// Starts erasing the first `size` bytes of ota_0 in the background.
+void preerase_start(size_t size);
+
+// Waits for the background erase, then returns true if the first `size` bytes of
+// `partition` are erased and unused. Claims the region, so later calls return false.
+bool preerase_take(const esp_partition_t *partition, size_t size);
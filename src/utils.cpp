@@ -23,6 +23,11 @@ void print_hash(const char *prefix, const uint8_t *hash) {
     for(int i=0; i<32; i++) printf("%02x", hash[i]);
     printf("\r\n");
 }   
+
+// hex must hold 65 bytes (64 digits + terminator)
+void hash_to_hex(const uint8_t *hash, char *hex) {
+    for(int i=0; i<32; i++) snprintf(&hex[i * 2], 3, "%02x", hash[i]);
+}
     
 char *getDeviceName() {
     static char name[20];
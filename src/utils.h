@@ -2,4 +2,5 @@
 
 void corrupt_partition(const esp_partition_t *partition);
 void print_hash(const char *prefix, const uint8_t *hash);
+void hash_to_hex(const uint8_t *hash, char *hex);
 char *getDeviceName();
\ No newline at end of file
@@ -31,7 +31,7 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
     }
 }
 
-void wifi_connect(const nvs_config_t *config) {
+bool wifi_connect(const nvs_config_t *config) {
     event_group_handle = xEventGroupCreate();
     esp_netif_create_default_wifi_sta();
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -46,5 +46,10 @@ void wifi_connect(const nvs_config_t *config) {
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
     EventBits_t bits = xEventGroupWaitBits(event_group_handle, BIT_CONNECTED | BIT_FAIL, pdFALSE, pdFALSE, portMAX_DELAY);
-    if (bits & BIT_FAIL) FAIL("Failed to connect to WiFi");
+    if (bits & BIT_FAIL) {
+        INFO("Failed to connect to WiFi");
+        esp_wifi_stop();
+        return false;
+    }
+    return true;
 }
@@ -1,3 +1,3 @@
 #pragma once
 #include "nvs_config.h"
-void wifi_connect(const nvs_config_t *config);
+bool wifi_connect(const nvs_config_t *config);